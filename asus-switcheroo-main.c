@@ -0,0 +1,804 @@
+/*
+ * VGA switcheroo driver for ASUS laptops
+ *
+ * Based on drivers/gpu/drm/nouveau/nouveau_acpi.c
+ *
+ * Copyright 2011 Red Hat, Inc
+ *
+ * Author: Alex Williamson <alex.williamson@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/delay.h>
+#include <linux/pci.h>
+#include <linux/acpi.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+#include <linux/kallsyms.h>
+#include <linux/vga_switcheroo.h>
+#include <acpi/acpi_bus.h>
+#include <acpi/acpi_drivers.h>
+#include <acpi/video.h>
+
+#include "switcheroo-common.h"
+#include "switcheroo-irqstat.h"
+#include "switcheroo-stress.h"
+#include "switcheroo-trace.h"
+
+#define DSM_SUPPORTED 0x00
+#define DSM_SUPPORTED_FUNCTIONS 0x00
+
+#define DSM_LED 0x02
+#define DSM_LED_STATE 0x00
+#define DSM_LED_OFF 0x10
+#define DSM_LED_STAMINA 0x11
+#define DSM_LED_SPEED 0x12
+#define DSM_LED_BUDGET_KEY "_DSM:2"	/* see switcheroo_budget_key() */
+
+#define DSM_POWER 0x03
+#define DSM_POWER_STATE 0x00
+#define DSM_POWER_SPEED 0x01
+#define DSM_POWER_STAMINA 0x02
+
+static acpi_handle dsm_handle;
+static acpi_handle discrete_handle;
+static acpi_handle igd_handle;
+
+static struct pci_dev *discrete_dev;
+static bool dummy_client;
+
+static char *ac_policy;
+static char *battery_policy;
+static unsigned int policy_debounce_ms = 100;
+static unsigned int request_window_ms = 50;
+
+static unsigned int irq_warn_rate = 100;
+static bool power_off_on_load;
+static bool defer_reprobe;
+static bool igd_power_control;
+static char *backend;
+static unsigned int bench_p99_budget_us;
+static unsigned int firmware_budget_ms = 500;
+static char *energy_battery;
+static unsigned int energy_interval_ms = 1000;
+static unsigned int energy_window_ms = 10000;
+static struct dentry *asus_switcheroo_debugfs;
+static struct switcheroo_trace_user asus_switcheroo_trace;
+
+static const char * const power_methods[] = { "_PS0", "_PS3", "_PR0", "_PR3" };
+static bool igd_power_manageable;
+static u64 igd_resume_ns;
+
+static struct switcheroo_irqstat asus_switcheroo_irqstat = {
+	.name = "Asus switcheroo",
+	.warn_rate = &irq_warn_rate,
+};
+
+static struct switcheroo_load_off asus_switcheroo_load_off = {
+	.name = "Asus switcheroo",
+};
+
+static struct switcheroo_stats asus_switcheroo_stats;
+static struct switcheroo_dummy asus_switcheroo_dummy;
+
+static struct switcheroo_energy asus_switcheroo_energy = {
+	.name = "Asus switcheroo",
+	.battery = &energy_battery,
+	.interval_ms = &energy_interval_ms,
+	.window_ms = &energy_window_ms,
+};
+
+static struct switcheroo_request asus_switcheroo_request = {
+	.name = "Asus switcheroo",
+	.window_ms = &request_window_ms,
+	.stats = &asus_switcheroo_stats,
+};
+
+static struct switcheroo_policy asus_switcheroo_policy = {
+	.name = "Asus switcheroo",
+	.req = &asus_switcheroo_request,
+	.debounce_ms = &policy_debounce_ms,
+};
+
+static struct switcheroo_bench asus_switcheroo_bench = {
+	.p99_budget_us = &bench_p99_budget_us,
+};
+
+static struct switcheroo_stress asus_switcheroo_stress;
+
+/* What each device's firmware offers, found at detect time */
+struct asus_switcheroo_caps {
+	u32 dsm_functions;
+	bool mxmx;
+	bool mxds;
+	unsigned int power_methods;
+};
+
+static struct asus_switcheroo_caps igd_caps, dis_caps;
+
+static const char dsm_uuid[] = {
+	0xA0, 0xA0, 0x95, 0x9D, 0x60, 0x00, 0x48, 0x4D,
+	0xB3, 0x4D, 0x7E, 0x5F, 0xEA, 0x12, 0x9F, 0xD4,
+};
+
+static int asus_switcheroo_dsm_call(acpi_handle handle, int func, int arg,
+				    u32 *result)
+{
+	struct acpi_buffer output = { ACPI_ALLOCATE_BUFFER, NULL };
+	struct acpi_object_list input;
+	union acpi_object params[4], elements[4];
+	union acpi_object *obj;
+	ktime_t start = ktime_get();
+	int i, err;
+
+	input.count = 4;
+	input.pointer = params;
+	params[0].type = ACPI_TYPE_BUFFER;
+	params[0].buffer.length = sizeof(dsm_uuid);
+	params[0].buffer.pointer = (char *)dsm_uuid;
+	params[1].type = ACPI_TYPE_INTEGER;
+	params[1].integer.value = 0; /* revision ID - unused */
+	params[2].type = ACPI_TYPE_INTEGER;
+	params[2].integer.value = func;
+	params[3].type = ACPI_TYPE_PACKAGE;
+	params[3].package.count = 4;
+	params[3].package.elements = elements;
+	for (i = 0; i < 4; i++) {
+		elements[i].type = ACPI_TYPE_INTEGER;
+		elements[i].integer.value = (arg >> (i * 8)) & 0xff;
+	}
+
+	err = switcheroo_evaluate(handle, "_DSM", &input, &output);
+	switcheroo_trace("dsm", "_DSM", func << 16 | arg, err, start);
+	if (err) {
+		printk(KERN_INFO "failed to evaluate _DSM: %d\n", err);
+		return err;
+	}
+
+	obj = (union acpi_object *)output.pointer;
+
+	if (obj && obj->type == ACPI_TYPE_INTEGER) {
+		if (obj->integer.value == 0x80000002)
+			err = -ENODEV;
+		else if (result)
+			*result = obj->integer.value;
+	} else if (obj && obj->type == ACPI_TYPE_BUFFER && result) {
+		*result = 0;
+		for (i = 0; i < obj->buffer.length && i < 4; i++)
+			*result |= obj->buffer.pointer[i] << (i * 8);
+	}
+
+	kfree(output.pointer);
+	return err;
+}
+
+static int asus_switcheroo_acpi_mux(acpi_handle handle)
+{
+	struct acpi_object_list input;
+	union acpi_object param;
+	ktime_t start = ktime_get();
+	int err;
+
+	input.count = 1;
+	input.pointer = &param;
+	param.type = ACPI_TYPE_INTEGER;
+	param.integer.value = 1;
+
+	/* I don't really know what these do, but it seems to work */
+	err = switcheroo_evaluate(handle, "MXMX", &input, NULL);
+	switcheroo_trace("mux", "MXMX", 1, err, start);
+	if (err) {
+		printk(KERN_INFO "failed to evaluate MXMX: %d\n", err);
+		return err;
+	}
+
+	start = ktime_get();
+	err = switcheroo_evaluate(handle, "MXDS", &input, NULL);
+	switcheroo_trace("mux", "MXDS", 1, err, start);
+	if (err) {
+		printk(KERN_INFO "failed to evaluate MXMX: %d\n", err);
+		return err;
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+static void asus_switcheroo_force_nouveau_reprobe(void)
+{
+	void *dev = pci_get_drvdata(discrete_dev);
+	void (*nouveau_fbcon_hook)(void *);
+
+	if (!discrete_dev)
+		return;
+
+	nouveau_fbcon_hook =
+		(void *)kallsyms_lookup_name("nouveau_fbcon_output_poll_changed");
+
+	if (!nouveau_fbcon_hook) {
+		printk("Can't hook to nouveau_fbcon_output_poll_changed\n");
+		return;
+	}
+	nouveau_fbcon_hook(dev);
+}
+#endif
+
+/* Newer kernels ask the client to reprobe themselves */
+static struct switcheroo_reprobe asus_switcheroo_reprobe = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+	.reprobe = asus_switcheroo_force_nouveau_reprobe,
+#endif
+	.defer = &defer_reprobe,
+};
+
+static int asus_switcheroo_dsm_led(int arg)
+{
+	return asus_switcheroo_dsm_call(dsm_handle, DSM_LED, arg, NULL);
+}
+
+static int asus_switcheroo_dsm_power(int arg)
+{
+	return asus_switcheroo_dsm_call(dsm_handle, DSM_POWER, arg, NULL);
+}
+
+/*
+ * The _DSM functions the firmware says it supports pick one of these, so
+ * a switch never calls one it doesn't.  Firmware that answers the
+ * supported query with nothing useful gets everything, as before.
+ */
+struct asus_dsm_ops {
+	const char *name;
+	int (*led)(int arg);
+	int (*power)(int arg);
+};
+
+static const struct asus_dsm_ops asus_dsm_ops_table[] = {
+	{ "mux", NULL, NULL },
+	{ "mux+led", asus_switcheroo_dsm_led, NULL },
+	{ "mux+power", NULL, asus_switcheroo_dsm_power },
+	{ "mux+led+power", asus_switcheroo_dsm_led, asus_switcheroo_dsm_power },
+};
+
+static const struct asus_dsm_ops *asus_dsm_ops = &asus_dsm_ops_table[3];
+
+static void asus_switcheroo_select_ops(void)
+{
+	u32 funcs = dis_caps.dsm_functions;
+
+	if (!funcs)
+		funcs = ~0;
+
+	asus_dsm_ops = &asus_dsm_ops_table[!!(funcs & (1 << DSM_LED)) |
+					   !!(funcs & (1 << DSM_POWER)) << 1];
+	printk(KERN_INFO "Asus switcheroo: _DSM functions 0x%x, using %s\n",
+	       dis_caps.dsm_functions, asus_dsm_ops->name);
+}
+
+static int asus_switcheroo_switchto(enum vga_switcheroo_client_id id)
+{
+	ktime_t start = ktime_get();
+	int ret = 0, dsm_arg;
+
+	if (id == VGA_SWITCHEROO_IGD) {
+		asus_switcheroo_acpi_mux(igd_handle);
+		dsm_arg = DSM_LED_STAMINA;
+	} else {
+		asus_switcheroo_acpi_mux(discrete_handle);
+		dsm_arg = DSM_LED_SPEED;
+	}
+
+	/* The LED is just decoration */
+	if (asus_dsm_ops->led &&
+	    !switcheroo_firmware_degraded(DSM_LED_BUDGET_KEY))
+		ret = asus_dsm_ops->led(dsm_arg);
+	switcheroo_trace("switchto", NULL, id, ret, start);
+	switcheroo_stats_update(&asus_switcheroo_stats, SWITCHEROO_STAT_MUX,
+				id == VGA_SWITCHEROO_DIS, start);
+	if (id == VGA_SWITCHEROO_DIS && !dummy_client)
+		switcheroo_reprobe_request(&asus_switcheroo_reprobe);
+	switcheroo_reprobe_switched(&asus_switcheroo_reprobe, start);
+	if (dummy_client)
+		switcheroo_dummy_switched(&asus_switcheroo_dummy, id);
+	return ret;
+}
+
+/*
+ * The _DSM is the same method under both devices, its power function is
+ * for the discrete GPU whichever handle it's called on.  The IGD can only
+ * be powered down through its own ACPI power methods or power resources.
+ * The PCI core may already have run these when i915 put the device in
+ * D3hot, in which case this is a no-op, but not all firmware makes the
+ * device power manageable from PCI, so do it from the handler once the
+ * IGD is inactive.
+ */
+static int asus_switcheroo_igd_power_state(enum vga_switcheroo_state state)
+{
+	ktime_t start = ktime_get();
+	int ret = 0;
+
+	if (igd_power_control && igd_power_manageable) {
+		ret = acpi_bus_set_power(igd_handle,
+					 state == VGA_SWITCHEROO_ON ?
+					 ACPI_STATE_D0 : ACPI_STATE_D3);
+		switcheroo_trace("igd_power", state == VGA_SWITCHEROO_ON ?
+				 "_PS0" : "_PS3", state, ret, start);
+		if (ret)
+			printk(KERN_WARNING "Asus switcheroo: failed to set "
+			       "IGD power state: %d\n", ret);
+		else if (state == VGA_SWITCHEROO_ON)
+			igd_resume_ns = ktime_to_ns(ktime_sub(ktime_get(),
+							      start));
+	}
+
+	switcheroo_stats_update(&asus_switcheroo_stats,
+				SWITCHEROO_STAT_IGD_POWER,
+				state == VGA_SWITCHEROO_ON, start);
+	return ret;
+}
+
+static int asus_switcheroo_power_state(enum vga_switcheroo_client_id id,
+				     enum vga_switcheroo_state state)
+{
+	ktime_t start = ktime_get();
+	int ret = 0, dsm_arg;
+
+	if (id == VGA_SWITCHEROO_IGD) {
+		ret = asus_switcheroo_igd_power_state(state);
+		goto out;
+	}
+
+	if (state == VGA_SWITCHEROO_ON)
+		dsm_arg = DSM_POWER_SPEED;
+	else
+		dsm_arg = DSM_POWER_STAMINA;
+
+	if (asus_dsm_ops->power) {
+		ret = asus_dsm_ops->power(dsm_arg);
+		if (state == VGA_SWITCHEROO_ON)
+			msleep(10);
+	}
+
+	switcheroo_trace("power_state", NULL, id << 16 | state, ret, start);
+	switcheroo_stats_update(&asus_switcheroo_stats, SWITCHEROO_STAT_DIS_POWER,
+				state == VGA_SWITCHEROO_ON, start);
+out:
+	if (dummy_client && state == VGA_SWITCHEROO_OFF)
+		switcheroo_dummy_done(&asus_switcheroo_dummy, id);
+	return ret;
+}
+
+static int asus_switcheroo_handler_init(void)
+{
+	return 0;
+}
+
+static int asus_switcheroo_get_client_id(struct pci_dev *pdev)
+{
+	if (pdev->vendor == PCI_VENDOR_ID_INTEL)
+		return VGA_SWITCHEROO_IGD;
+
+	return VGA_SWITCHEROO_DIS;
+}
+
+static struct vga_switcheroo_handler asus_dsm_handler = {
+	.switchto = asus_switcheroo_switchto,
+	.power_state = asus_switcheroo_power_state,
+	.init = asus_switcheroo_handler_init,
+	.get_client_id = asus_switcheroo_get_client_id,
+};
+
+static void asus_switcheroo_set_state(struct pci_dev *pdev,
+				      enum vga_switcheroo_state state)
+{
+	ktime_t start = ktime_get();
+
+	switcheroo_irqstat_set_state(&asus_switcheroo_irqstat,
+				     SWITCHEROO_IRQ_TRANSITION);
+
+	if (state == VGA_SWITCHEROO_ON) {
+		switcheroo_set_power_state(pdev, PCI_D0);
+		pci_restore_state(pdev);
+		if (pci_enable_device(pdev))
+			printk(KERN_WARNING
+			       "Asus switcher: failed to enable %s\n",
+			       dev_name(&pdev->dev));
+		pci_set_master(pdev);
+		switcheroo_irqstat_set_state(&asus_switcheroo_irqstat,
+					     SWITCHEROO_IRQ_ON);
+	} else {
+		pci_save_state(pdev);
+		pci_clear_master(pdev);
+		pci_disable_device(pdev);
+		switcheroo_set_power_state(pdev, PCI_D3hot);
+		switcheroo_irqstat_set_state(&asus_switcheroo_irqstat,
+					     SWITCHEROO_IRQ_OFF);
+	}
+
+	switcheroo_trace("set_state", NULL, state, 0, start);
+	switcheroo_stats_update(&asus_switcheroo_stats, SWITCHEROO_STAT_DUMMY,
+				state == VGA_SWITCHEROO_ON, start);
+	switcheroo_dummy_switched(&asus_switcheroo_dummy,
+				  state == VGA_SWITCHEROO_ON ?
+				  VGA_SWITCHEROO_DIS : VGA_SWITCHEROO_IGD);
+}
+
+static bool asus_switcheroo_can_switch(struct pci_dev *pdev)
+{
+	return switcheroo_dummy_can_switch(&asus_switcheroo_dummy);
+}
+
+static unsigned int asus_switcheroo_power_methods(acpi_handle handle)
+{
+	acpi_handle test_handle;
+	unsigned int present = 0;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(power_methods); i++) {
+		acpi_status status = switcheroo_get_handle(handle,
+					(acpi_string)power_methods[i],
+					&test_handle);
+		if (ACPI_SUCCESS(status))
+			present |= 1 << i;
+	}
+	return present;
+}
+
+static bool asus_switcheroo_dsm_pci_probe(struct pci_dev *pdev,
+					  struct asus_switcheroo_caps *caps)
+{
+	acpi_handle handle, test_handle;
+	acpi_status status;
+	int ret;
+
+	handle = DEVICE_ACPI_HANDLE(&pdev->dev);
+	if (!handle)
+		return false;
+
+	status = switcheroo_get_handle(handle, "_DSM", &test_handle);
+	if (ACPI_FAILURE(status)) {
+		return false;
+	}
+
+	ret = asus_switcheroo_dsm_call(handle, DSM_SUPPORTED,
+				       DSM_SUPPORTED_FUNCTIONS,
+				       &caps->dsm_functions);
+	if (ret < 0)
+		return false;
+
+	caps->power_methods = asus_switcheroo_power_methods(handle);
+
+	status = switcheroo_get_handle(handle, "MXMX", &test_handle);
+	if (ACPI_FAILURE(status)) {
+		return false;
+	}
+	caps->mxmx = true;
+
+	status = switcheroo_get_handle(handle, "MXDS", &test_handle);
+	if (ACPI_FAILURE(status)) {
+		return false;
+	}
+	caps->mxds = true;
+
+	dsm_handle = handle;
+	return true;
+}
+
+static void asus_switcheroo_igd_power_probe(void)
+{
+	igd_power_manageable = acpi_bus_power_manageable(igd_handle);
+	printk(KERN_INFO "Asus switcheroo: IGD power methods 0x%x, %s\n",
+	       igd_caps.power_methods, igd_power_manageable ?
+	       "power manageable" : "no IGD power control");
+}
+
+static bool asus_switcheroo_dsm_detect(void)
+{
+	struct pci_dev *pdev = NULL;
+	int class = PCI_CLASS_DISPLAY_VGA << 8;
+	int vga_count = 0;
+
+	while ((pdev = pci_get_class(class, pdev)) != NULL) {
+		struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+		acpi_handle handle;
+
+		vga_count++;
+
+		/* The _DSM actually exists on both devices on this system */
+		if (!asus_switcheroo_dsm_pci_probe(pdev,
+				pdev->vendor == PCI_VENDOR_ID_INTEL ?
+				&igd_caps : &dis_caps))
+			return false;
+
+		handle = DEVICE_ACPI_HANDLE(&pdev->dev);
+		if (!handle)
+			return false;
+
+		if (pdev->vendor == PCI_VENDOR_ID_INTEL) {
+			igd_handle = handle;
+		} else {
+			discrete_handle = handle;
+			discrete_dev = pdev;
+		}
+
+		acpi_get_name(handle, ACPI_FULL_PATHNAME, &buf);
+		printk(KERN_INFO "Found VGA device %s (%s): %s\n",
+		       dev_name(&pdev->dev), (char *)buf.pointer,
+		       pdev->vendor == PCI_VENDOR_ID_INTEL ? "IGD" : "DIS");
+		kfree(buf.pointer);
+	}
+
+	if (vga_count == 2 && dsm_handle && igd_handle && discrete_handle) {
+		struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+
+		acpi_get_name(dsm_handle, ACPI_FULL_PATHNAME, &buf);
+		printk(KERN_INFO
+		       "Asus switcheroo: detected DSM switching method "
+		       "%s handle\n", (char *)buf.pointer);
+		kfree(buf.pointer);
+		asus_switcheroo_igd_power_probe();
+		return true;
+	}
+	return false;
+}
+
+/* Nothing to find on a simulated backend, just make up the handles the
+ * handler calls go through */
+static bool asus_switcheroo_fake_detect(void)
+{
+	if (ACPI_FAILURE(switcheroo_get_handle(NULL, (acpi_string)"IGD",
+					       &igd_handle)) ||
+	    ACPI_FAILURE(switcheroo_get_handle(NULL, (acpi_string)"DIS",
+					       &discrete_handle)))
+		return false;
+
+	dsm_handle = discrete_handle;
+	return true;
+}
+
+static int asus_switcheroo_igd_power_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	seq_printf(m, "methods");
+	for (i = 0; i < ARRAY_SIZE(power_methods); i++)
+		if (igd_caps.power_methods & (1 << i))
+			seq_printf(m, " %s", power_methods[i]);
+	seq_printf(m, "\nmanageable %d\ncontrol %d\nlast_resume_us %llu\n",
+		   igd_power_manageable, igd_power_control,
+		   div_u64(igd_resume_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static int asus_switcheroo_igd_power_open(struct inode *inode,
+					  struct file *file)
+{
+	return single_open(file, asus_switcheroo_igd_power_show, NULL);
+}
+
+static const struct file_operations asus_switcheroo_igd_power_fops = {
+	.owner = THIS_MODULE,
+	.open = asus_switcheroo_igd_power_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void asus_switcheroo_caps_show_one(struct seq_file *m,
+					  const char *name,
+					  struct asus_switcheroo_caps *caps)
+{
+	int i;
+
+	seq_printf(m, "%s 0x%08x%s%s", name, caps->dsm_functions,
+		   caps->mxmx ? " MXMX" : "", caps->mxds ? " MXDS" : "");
+	for (i = 0; i < ARRAY_SIZE(power_methods); i++)
+		if (caps->power_methods & (1 << i))
+			seq_printf(m, " %s", power_methods[i]);
+	seq_printf(m, "\n");
+}
+
+/* Per device: supported _DSM function bitmap and the methods present,
+ * then the op table that was picked from them */
+static int asus_switcheroo_caps_show(struct seq_file *m, void *unused)
+{
+	asus_switcheroo_caps_show_one(m, "igd", &igd_caps);
+	asus_switcheroo_caps_show_one(m, "dis", &dis_caps);
+	seq_printf(m, "ops %s\n", asus_dsm_ops->name);
+	return 0;
+}
+
+static int asus_switcheroo_caps_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, asus_switcheroo_caps_show, NULL);
+}
+
+static const struct file_operations asus_switcheroo_caps_fops = {
+	.owner = THIS_MODULE,
+	.open = asus_switcheroo_caps_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+struct vga_switcheroo_client_ops asus_switcheroo_ops = {
+	.set_gpu_state = asus_switcheroo_set_state,
+	.reprobe = NULL,
+	.can_switch = asus_switcheroo_can_switch,
+};
+#endif
+
+int __init asus_switcheroo_init(void)
+{
+	ktime_t load_time = ktime_get();
+
+	switcheroo_backend_select("Asus switcheroo", backend,
+				  &firmware_budget_ms);
+	if (switcheroo_backend_simulated()) {
+		if (!asus_switcheroo_fake_detect())
+			return 0;
+	} else if (!asus_switcheroo_dsm_detect())
+		return 0;
+
+	asus_switcheroo_select_ops();
+
+	asus_switcheroo_debugfs = debugfs_create_dir("asus-switcheroo", NULL);
+	switcheroo_trace_init(&asus_switcheroo_trace, "Asus switcheroo",
+			      asus_switcheroo_debugfs);
+	switcheroo_stats_init(&asus_switcheroo_stats, "asus-switcheroo",
+			      asus_switcheroo_debugfs);
+	switcheroo_energy_init(&asus_switcheroo_energy, &asus_switcheroo_stats,
+			       asus_switcheroo_debugfs);
+	switcheroo_reprobe_init(&asus_switcheroo_reprobe,
+				asus_switcheroo_debugfs);
+	switcheroo_request_init(&asus_switcheroo_request,
+				asus_switcheroo_debugfs);
+	if (!IS_ERR_OR_NULL(asus_switcheroo_debugfs))
+		debugfs_create_file("igd_power", 0444, asus_switcheroo_debugfs,
+				    NULL, &asus_switcheroo_igd_power_fops);
+	if (!IS_ERR_OR_NULL(asus_switcheroo_debugfs))
+		debugfs_create_file("capabilities", 0444,
+				    asus_switcheroo_debugfs, NULL,
+				    &asus_switcheroo_caps_fops);
+
+	/* Only the benchmark and stress test drive the handler on a
+	 * simulated backend */
+	switcheroo_backend_init(&asus_switcheroo_bench, &asus_dsm_handler,
+				asus_switcheroo_debugfs);
+	switcheroo_request_simulated(&asus_switcheroo_request,
+				     &asus_switcheroo_bench);
+	switcheroo_stress_init(&asus_switcheroo_stress, &asus_switcheroo_bench,
+			       &asus_switcheroo_request, &asus_switcheroo_policy,
+			       asus_switcheroo_debugfs);
+
+	asus_switcheroo_policy.ac = ac_policy;
+	asus_switcheroo_policy.battery = battery_policy;
+	/* The requests go to the simulated handler, so the policy can too */
+	if (switcheroo_backend_simulated()) {
+		switcheroo_policy_init(&asus_switcheroo_policy);
+		return 0;
+	}
+
+	vga_switcheroo_register_handler(&asus_dsm_handler);
+
+	/*
+	 * The core registers the dummy client as powered on and wouldn't
+	 * turn it back on before switching to it, so the two don't mix.
+	 */
+	if (power_off_on_load && dummy_client)
+		printk(KERN_WARNING "Asus switcheroo: power_off_on_load "
+		       "ignored with dummy_client\n");
+	else if (power_off_on_load) {
+		asus_switcheroo_load_off.handler = &asus_dsm_handler;
+		asus_switcheroo_load_off.pdev = discrete_dev;
+		switcheroo_load_off(&asus_switcheroo_load_off, load_time);
+	}
+
+	if (dummy_client) {
+		switcheroo_dummy_init(&asus_switcheroo_dummy, discrete_dev,
+				      asus_switcheroo_debugfs);
+		switcheroo_irqstat_init(&asus_switcheroo_irqstat,
+					asus_switcheroo_debugfs);
+		switcheroo_irqstat_start(&asus_switcheroo_irqstat,
+					 discrete_dev->irq, SWITCHEROO_IRQ_ON);
+	}
+
+	if (dummy_client)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+		vga_switcheroo_register_client(discrete_dev,
+					       &asus_switcheroo_ops);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+		vga_switcheroo_register_client(discrete_dev,
+					       asus_switcheroo_set_state, NULL,
+					       asus_switcheroo_can_switch);
+#else
+		vga_switcheroo_register_client(discrete_dev,
+					       asus_switcheroo_set_state,
+					       asus_switcheroo_can_switch);
+#endif
+
+	switcheroo_policy_init(&asus_switcheroo_policy);
+	return 0;
+}
+
+void __exit asus_switcheroo_exit(void)
+{
+	switcheroo_policy_exit(&asus_switcheroo_policy);
+	switcheroo_request_exit(&asus_switcheroo_request);
+	switcheroo_load_off_exit(&asus_switcheroo_load_off);
+	debugfs_remove_recursive(asus_switcheroo_debugfs);
+	if (!switcheroo_backend_simulated()) {
+		if (dummy_client)
+			vga_switcheroo_unregister_client(discrete_dev);
+		vga_switcheroo_unregister_handler();
+	}
+	switcheroo_reprobe_exit(&asus_switcheroo_reprobe);
+	switcheroo_energy_exit(&asus_switcheroo_energy);
+	switcheroo_stats_exit(&asus_switcheroo_stats);
+	if (dummy_client)
+		switcheroo_irqstat_exit(&asus_switcheroo_irqstat);
+	switcheroo_backend_exit();
+	switcheroo_trace_exit(&asus_switcheroo_trace);
+}
+
+#ifndef SWITCHEROO_COMBINED
+module_init(asus_switcheroo_init);
+module_exit(asus_switcheroo_exit);
+#endif
+
+module_param(dummy_client, bool, 0444);
+MODULE_PARM_DESC(dummy_client, "Enable dummy VGA switcheroo client support");
+
+module_param(ac_policy, charp, 0444);
+MODULE_PARM_DESC(ac_policy, "Switcheroo commands to run when AC is plugged in (eg. \"DIS\")");
+
+module_param(battery_policy, charp, 0444);
+MODULE_PARM_DESC(battery_policy, "Switcheroo commands to run when running on battery (eg. \"IGD,OFF\")");
+
+module_param(policy_debounce_ms, uint, 0644);
+MODULE_PARM_DESC(policy_debounce_ms, "Delay before acting on AC adapter events (default 100ms)");
+
+module_param(request_window_ms, uint, 0644);
+MODULE_PARM_DESC(request_window_ms, "Window in which queued switch requests are collapsed (default 50ms)");
+
+module_param(irq_warn_rate, uint, 0644);
+MODULE_PARM_DESC(irq_warn_rate, "Warn when the dummy client irq fires more than this many times a second while off (default 100, 0 to disable)");
+
+module_param(power_off_on_load, bool, 0444);
+MODULE_PARM_DESC(power_off_on_load, "Power off discrete graphics at load if no driver is bound to it");
+
+module_param(igd_power_control, bool, 0644);
+MODULE_PARM_DESC(igd_power_control, "Power down the IGD through ACPI while running on discrete graphics");
+
+module_param(defer_reprobe, bool, 0644);
+MODULE_PARM_DESC(defer_reprobe, "Reprobe nouveau outputs from a workqueue after switching (pre-2.6.38 kernels)");
+
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Firmware backend, \"acpi\" (default), \"record\" to log firmware calls, or \"fake\" or \"replay\" for benchmarking without the hardware");
+
+module_param(bench_p99_budget_us, uint, 0644);
+MODULE_PARM_DESC(bench_p99_budget_us, "Fail the simulated backend benchmark if any operation's 99th percentile exceeds this (default 0, no limit)");
+
+module_param(firmware_budget_ms, uint, 0644);
+MODULE_PARM_DESC(firmware_budget_ms, "Default budget for each firmware method and optional operation, logged and skipped if optional once over it (default 500ms, 0 to disable)");
+
+module_param(energy_battery, charp, 0444);
+MODULE_PARM_DESC(energy_battery, "Sample this battery's draw (eg. \"BAT0\") for per state and per transition power figures (default off)");
+
+module_param(energy_interval_ms, uint, 0644);
+MODULE_PARM_DESC(energy_interval_ms, "Battery draw sampling interval (default 1000ms)");
+
+module_param(energy_window_ms, uint, 0644);
+MODULE_PARM_DESC(energy_window_ms, "How long after a transition its energy cost is measured (default 10000ms)");
+
+#ifndef SWITCHEROO_COMBINED
+MODULE_AUTHOR("Alex Williamson <alex.williamson@redhat.com>");
+MODULE_DESCRIPTION("Experimental Asus hybrid graphics switcheroo");
+MODULE_LICENSE("GPL v2");
+MODULE_VERSION("0.2");
+#endif
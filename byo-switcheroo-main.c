@@ -15,6 +15,7 @@
 #include <linux/pci.h>
 #include <linux/acpi.h>
 #include <linux/slab.h>
+#include <linux/debugfs.h>
 #include <linux/version.h>
 #include <linux/kallsyms.h>
 #include <linux/vga_switcheroo.h>
@@ -22,6 +23,11 @@
 #include <acpi/acpi_drivers.h>
 #include <acpi/video.h>
 
+#include "switcheroo-common.h"
+#include "switcheroo-irqstat.h"
+#include "switcheroo-stress.h"
+#include "switcheroo-trace.h"
+
 static int igd_vendor = PCI_VENDOR_ID_INTEL;
 static char *model;
 static char *switchto_igd;
@@ -31,7 +37,59 @@ static char *power_state_igd_off;
 static char *power_state_dis_on;
 static char *power_state_dis_off;
 static bool dummy_client;
-static bool dummy_client_switched;
+static char *ac_policy;
+static char *battery_policy;
+static unsigned int policy_debounce_ms = 100;
+static unsigned int request_window_ms = 50;
+
+static unsigned int irq_warn_rate = 100;
+static bool power_off_on_load;
+static bool defer_reprobe;
+static char *backend;
+static unsigned int bench_p99_budget_us;
+static unsigned int firmware_budget_ms = 500;
+static char *energy_battery;
+static unsigned int energy_interval_ms = 1000;
+static unsigned int energy_window_ms = 10000;
+static struct dentry *byo_switcheroo_debugfs;
+static struct switcheroo_trace_user byo_switcheroo_trace;
+
+static struct switcheroo_irqstat byo_switcheroo_irqstat = {
+	.name = "BYO-switcheroo",
+	.warn_rate = &irq_warn_rate,
+};
+
+static struct switcheroo_load_off byo_switcheroo_load_off = {
+	.name = "BYO-switcheroo",
+};
+
+static struct switcheroo_stats byo_switcheroo_stats;
+static struct switcheroo_dummy byo_switcheroo_dummy;
+
+static struct switcheroo_energy byo_switcheroo_energy = {
+	.name = "BYO-switcheroo",
+	.battery = &energy_battery,
+	.interval_ms = &energy_interval_ms,
+	.window_ms = &energy_window_ms,
+};
+
+static struct switcheroo_request byo_switcheroo_request = {
+	.name = "BYO-switcheroo",
+	.window_ms = &request_window_ms,
+	.stats = &byo_switcheroo_stats,
+};
+
+static struct switcheroo_policy byo_switcheroo_policy = {
+	.name = "BYO-switcheroo",
+	.req = &byo_switcheroo_request,
+	.debounce_ms = &policy_debounce_ms,
+};
+
+static struct switcheroo_bench byo_switcheroo_bench = {
+	.p99_budget_us = &bench_p99_budget_us,
+};
+
+static struct switcheroo_stress byo_switcheroo_stress;
 
 static struct pci_dev *igd_dev, *dis_dev;
 static acpi_handle igd_handle, dis_handle;
@@ -41,14 +99,25 @@ static acpi_handle igd_handle, dis_handle;
 #define UL30VT_SWITCHTO_DIS "MXMX 0x1; MXDS 0x1; _DSM {0xA0,0xA0,0x95,0x9D,0x60,0x00,0x48,0x4D,0xB3,0x4D,0x7E,0x5F,0xEA,0x12,0x9F,0xD4} 0x102 0x2 {0x12,0x0,0x0,0x0}; !nouveau_fbcon_output_poll_changed"
 #define UL30VT_SWITCHTO_IGD "MXMX 0x1; MXDS 0x1; _DSM {0xA0,0xA0,0x95,0x9D,0x60,0x00,0x48,0x4D,0xB3,0x4D,0x7E,0x5F,0xEA,0x12,0x9F,0xD4} 0x102 0x2 {0x11,0x0,0x0,0x0}"
 
+/* For backend=fake, where there's nothing to take scripts from: the
+ * UL30VT ones less the delay and the nouveau hook, and the IGD's standard
+ * power methods */
+#define FAKE_DIS_OFF UL30VT_DIS_OFF
+#define FAKE_DIS_ON "_DSM {0xA0,0xA0,0x95,0x9D,0x60,0x00,0x48,0x4D,0xB3,0x4D,0x7E,0x5F,0xEA,0x12,0x9F,0xD4} 0x102 0x3 {0x1,0x0,0x0,0x0}"
+#define FAKE_SWITCHTO_DIS "MXMX 0x1; MXDS 0x1; _DSM {0xA0,0xA0,0x95,0x9D,0x60,0x00,0x48,0x4D,0xB3,0x4D,0x7E,0x5F,0xEA,0x12,0x9F,0xD4} 0x102 0x2 {0x12,0x0,0x0,0x0}"
+#define FAKE_SWITCHTO_IGD UL30VT_SWITCHTO_IGD
+#define FAKE_IGD_OFF "_PS3"
+#define FAKE_IGD_ON "_PS0"
+
 static acpi_status do_acpi_call(const char *method, int argc, union acpi_object *argv)
 {
 	acpi_status status;
 	acpi_handle handle;
 	struct acpi_object_list arg;
+	ktime_t start = ktime_get();
 
 	/* get the handle of the method, must be a fully qualified path */
-	status = acpi_get_handle(NULL, (acpi_string)method, &handle);
+	status = switcheroo_get_handle(NULL, (acpi_string)method, &handle);
 
 	if (ACPI_FAILURE(status)) {
 		printk(KERN_ERR "acpi_call: Cannot get handle: %s\n", acpi_format_exception(status));
@@ -60,7 +129,8 @@ static acpi_status do_acpi_call(const char *method, int argc, union acpi_object
 	arg.pointer = argv;
 
 	/* call the method */
-	status = acpi_evaluate_object(handle, NULL, &arg, NULL);
+	status = switcheroo_evaluate(handle, NULL, &arg, NULL);
+	switcheroo_trace("acpi_call", method, argc, status, start);
 	if (ACPI_FAILURE(status)) {
 		printk(KERN_ERR "acpi_call: Method call failed: %s\n", acpi_format_exception(status));
 		return status;
@@ -173,19 +243,34 @@ static char *parse_acpi_args(char *input, int *nargs, union acpi_object **args)
 	return input;
 }
 
-static void run_special(char *cmd)
+static void nouveau_reprobe(void)
 {
-	if (!strcmp(cmd, "nouveau_fbcon_output_poll_changed")) {
-		void *dev = pci_get_drvdata(dis_dev);
-		void (*func)(void *);
+	void *dev;
+	void (*func)(void *);
 
-		func = (void *)kallsyms_lookup_name(cmd);
+	if (!dis_dev)
+		return;
+	dev = pci_get_drvdata(dis_dev);
 
-		if (!func) {
-			printk("Can't hook to %s\n", cmd);
-			return;
-		}
-		func(dev);
+	func = (void *)kallsyms_lookup_name("nouveau_fbcon_output_poll_changed");
+
+	if (!func) {
+		printk("Can't hook to nouveau_fbcon_output_poll_changed\n");
+		return;
+	}
+	func(dev);
+}
+
+static struct switcheroo_reprobe byo_switcheroo_reprobe = {
+	.reprobe = nouveau_reprobe,
+	.defer = &defer_reprobe,
+};
+
+static void run_special(char *cmd)
+{
+	switcheroo_trace_event("special", cmd, 0, 0);
+	if (!strcmp(cmd, "nouveau_fbcon_output_poll_changed")) {
+		switcheroo_reprobe_request(&byo_switcheroo_reprobe);
 	} else if (!strncmp(cmd, "mdelay ", 7) && isdigit(cmd[7])) {
 		int ms = simple_strtol(cmd + 7, NULL, 0);
 		mdelay(ms);
@@ -248,6 +333,7 @@ static int acpi_call(char *script, acpi_handle handle)
 
 static int byo_switcheroo_switchto(enum vga_switcheroo_client_id id)
 {
+	ktime_t start = ktime_get();
 	int ret;
 
 	if (id == VGA_SWITCHEROO_IGD) {
@@ -256,12 +342,19 @@ static int byo_switcheroo_switchto(enum vga_switcheroo_client_id id)
 		ret = acpi_call(switchto_dis, dis_handle);
 	}
 
+	switcheroo_trace("switchto", NULL, id, ret, start);
+	switcheroo_stats_update(&byo_switcheroo_stats, SWITCHEROO_STAT_MUX,
+				id == VGA_SWITCHEROO_DIS, start);
+	switcheroo_reprobe_switched(&byo_switcheroo_reprobe, start);
+	if (dummy_client)
+		switcheroo_dummy_switched(&byo_switcheroo_dummy, id);
 	return ret;
 }
 
 static int byo_switcheroo_power_state(enum vga_switcheroo_client_id id,
 				      enum vga_switcheroo_state state)
 {
+	ktime_t start = ktime_get();
 	int ret;
 
 	if (id == VGA_SWITCHEROO_IGD) {
@@ -276,6 +369,14 @@ static int byo_switcheroo_power_state(enum vga_switcheroo_client_id id,
 			ret = acpi_call(power_state_dis_off, dis_handle);
 	}
 
+	switcheroo_trace("power_state", NULL, id << 16 | state, ret, start);
+	switcheroo_stats_update(&byo_switcheroo_stats,
+				id == VGA_SWITCHEROO_IGD ?
+				SWITCHEROO_STAT_IGD_POWER :
+				SWITCHEROO_STAT_DIS_POWER,
+				state == VGA_SWITCHEROO_ON, start);
+	if (dummy_client && state == VGA_SWITCHEROO_OFF)
+		switcheroo_dummy_done(&byo_switcheroo_dummy, id);
 	return ret;
 }
 
@@ -302,30 +403,41 @@ static struct vga_switcheroo_handler byo_switcheroo_handler = {
 static void dummy_switcheroo_set_state(struct pci_dev *pdev,
 				       enum vga_switcheroo_state state)
 {
+	ktime_t start = ktime_get();
+
+	switcheroo_irqstat_set_state(&byo_switcheroo_irqstat,
+				     SWITCHEROO_IRQ_TRANSITION);
+
 	if (state == VGA_SWITCHEROO_ON) {
-		printk(KERN_INFO
-		       "BYO switcheroo: turning on discrete graphics\n");
-		pci_set_power_state(pdev, PCI_D0);
+		switcheroo_set_power_state(pdev, PCI_D0);
 		pci_restore_state(pdev);
 		if (pci_enable_device(pdev))
 			printk(KERN_WARNING
 			       "BYO switcheroo: failed to enable %s\n",
 			       dev_name(&pdev->dev));
 		pci_set_master(pdev);
-		dummy_client_switched = true;
+		switcheroo_irqstat_set_state(&byo_switcheroo_irqstat,
+					     SWITCHEROO_IRQ_ON);
 	} else {
-		printk(KERN_INFO
-		       "BYO switcheroo: turning off discrete graphics\n");
 		pci_save_state(pdev);
 		pci_clear_master(pdev);
 		pci_disable_device(pdev);
-		pci_set_power_state(pdev, PCI_D3hot);
+		switcheroo_set_power_state(pdev, PCI_D3hot);
+		switcheroo_irqstat_set_state(&byo_switcheroo_irqstat,
+					     SWITCHEROO_IRQ_OFF);
 	}
+
+	switcheroo_trace("set_state", NULL, state, 0, start);
+	switcheroo_stats_update(&byo_switcheroo_stats, SWITCHEROO_STAT_DUMMY,
+				state == VGA_SWITCHEROO_ON, start);
+	switcheroo_dummy_switched(&byo_switcheroo_dummy,
+				  state == VGA_SWITCHEROO_ON ?
+				  VGA_SWITCHEROO_DIS : VGA_SWITCHEROO_IGD);
 }
 
 static bool dummy_switcheroo_can_switch(struct pci_dev *pdev)
 {
-	return !dummy_client_switched;
+	return switcheroo_dummy_can_switch(&byo_switcheroo_dummy);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
@@ -336,10 +448,56 @@ struct vga_switcheroo_client_ops byo_switcheroo_ops = {
 };
 #endif
 
+/* Scripts for known models, unless given on the command line */
+static void byo_switcheroo_preload(void)
+{
+	if (model) {
+		if (!strcmp(model, "AsusUL30VT")) {
+			printk(KERN_INFO "BYO-switcheroo preloading scripts for Asus UL30VT\n");
+			power_state_dis_off = kzalloc(strlen(UL30VT_DIS_OFF) + 1, GFP_KERNEL);
+			if (power_state_dis_off)
+				sprintf(power_state_dis_off, "%s", UL30VT_DIS_OFF);
+			power_state_dis_on = kzalloc(strlen(UL30VT_DIS_ON) + 1, GFP_KERNEL);
+			if (power_state_dis_on)
+				sprintf(power_state_dis_on, "%s", UL30VT_DIS_ON);
+			switchto_dis = kzalloc(strlen(UL30VT_SWITCHTO_DIS) + 1, GFP_KERNEL);
+			if (switchto_dis)
+				sprintf(switchto_dis, "%s", UL30VT_SWITCHTO_DIS);
+			switchto_igd = kzalloc(strlen(UL30VT_SWITCHTO_IGD) + 1, GFP_KERNEL);
+			if (switchto_igd)
+				sprintf(switchto_igd, "%s", UL30VT_SWITCHTO_IGD);
+			if (!power_state_dis_off || !power_state_dis_on || !switchto_dis || !switchto_igd)
+				printk(KERN_ERR "BYO-switcheroo unable to allocate buffer for preload\n");
+		}
+	}
+}
+
+/* So the benchmark and stress test have something to run, only fills in
+ * the scripts that weren't given */
+static void byo_switcheroo_fake_scripts(void)
+{
+	if (!switchto_igd)
+		switchto_igd = kstrdup(FAKE_SWITCHTO_IGD, GFP_KERNEL);
+	if (!switchto_dis)
+		switchto_dis = kstrdup(FAKE_SWITCHTO_DIS, GFP_KERNEL);
+	if (!power_state_igd_on)
+		power_state_igd_on = kstrdup(FAKE_IGD_ON, GFP_KERNEL);
+	if (!power_state_igd_off)
+		power_state_igd_off = kstrdup(FAKE_IGD_OFF, GFP_KERNEL);
+	if (!power_state_dis_on)
+		power_state_dis_on = kstrdup(FAKE_DIS_ON, GFP_KERNEL);
+	if (!power_state_dis_off)
+		power_state_dis_off = kstrdup(FAKE_DIS_OFF, GFP_KERNEL);
+}
+
 static int __init byo_switcheroo_init(void)
 {
 	struct pci_dev *pdev = NULL;
 	int ret, class = PCI_CLASS_DISPLAY_VGA << 8;
+	ktime_t load_time = ktime_get();
+
+	switcheroo_backend_select("BYO-switcheroo", backend,
+				  &firmware_budget_ms);
 
 	while ((pdev = pci_get_class(class, pdev)) != NULL) {
 		struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
@@ -364,15 +522,52 @@ static int __init byo_switcheroo_init(void)
 		kfree(buf.pointer);
 	}
 
+	byo_switcheroo_debugfs = debugfs_create_dir("byo-switcheroo", NULL);
+	switcheroo_trace_init(&byo_switcheroo_trace, "BYO switcheroo",
+			      byo_switcheroo_debugfs);
+	switcheroo_stats_init(&byo_switcheroo_stats, "byo-switcheroo",
+			      byo_switcheroo_debugfs);
+	switcheroo_energy_init(&byo_switcheroo_energy, &byo_switcheroo_stats,
+			       byo_switcheroo_debugfs);
+	switcheroo_reprobe_init(&byo_switcheroo_reprobe, byo_switcheroo_debugfs);
+	switcheroo_request_init(&byo_switcheroo_request, byo_switcheroo_debugfs);
+	byo_switcheroo_preload();
+	if (switcheroo_backend == &switcheroo_fake_backend)
+		byo_switcheroo_fake_scripts();
+
+	/* Only the benchmark and stress test drive the handler on a
+	 * simulated backend */
+	switcheroo_backend_init(&byo_switcheroo_bench, &byo_switcheroo_handler,
+				byo_switcheroo_debugfs);
+	switcheroo_request_simulated(&byo_switcheroo_request,
+				     &byo_switcheroo_bench);
+	switcheroo_stress_init(&byo_switcheroo_stress, &byo_switcheroo_bench,
+			       &byo_switcheroo_request, &byo_switcheroo_policy,
+			       byo_switcheroo_debugfs);
+
+	byo_switcheroo_policy.ac = ac_policy;
+	byo_switcheroo_policy.battery = battery_policy;
+	/* The requests go to the simulated handler, so the policy can too */
+	if (switcheroo_backend_simulated()) {
+		switcheroo_policy_init(&byo_switcheroo_policy);
+		return 0;
+	}
+
 	ret = vga_switcheroo_register_handler(&byo_switcheroo_handler);
 	if (ret) {
 		printk(KERN_ERR "BYO-switcheroo failed to register handler\n");
-		return ret;
+		goto err_register;
 	}
 
 	printk(KERN_INFO "BYO-switcheroo handler registered\n");
 
 	if (dummy_client) {
+		switcheroo_dummy_init(&byo_switcheroo_dummy, dis_dev,
+				      byo_switcheroo_debugfs);
+		switcheroo_irqstat_init(&byo_switcheroo_irqstat,
+					byo_switcheroo_debugfs);
+		switcheroo_irqstat_start(&byo_switcheroo_irqstat,
+					 dis_dev->irq, SWITCHEROO_IRQ_ON);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
 		vga_switcheroo_register_client(dis_dev, &byo_switcheroo_ops);
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
@@ -390,33 +585,53 @@ static int __init byo_switcheroo_init(void)
 			printk(KERN_INFO "BYO-switcheroo dummy client registered\n");
 	}
 
-	if (model) {
-		if (!strcmp(model, "AsusUL30VT")) {
-			printk(KERN_INFO "BYO-switcheroo preloading scripts for Asus UL30VT\n");
-			power_state_dis_off = kzalloc(strlen(UL30VT_DIS_OFF) + 1, GFP_KERNEL);
-			if (power_state_dis_off)
-				sprintf(power_state_dis_off, "%s", UL30VT_DIS_OFF);
-			power_state_dis_on = kzalloc(strlen(UL30VT_DIS_ON) + 1, GFP_KERNEL);
-			if (power_state_dis_on)
-				sprintf(power_state_dis_on, "%s", UL30VT_DIS_ON);
-			switchto_dis = kzalloc(strlen(UL30VT_SWITCHTO_DIS) + 1, GFP_KERNEL);
-			if (switchto_dis)
-				sprintf(switchto_dis, "%s", UL30VT_SWITCHTO_DIS);
-			switchto_igd = kzalloc(strlen(UL30VT_SWITCHTO_IGD) + 1, GFP_KERNEL);
-			if (switchto_igd)
-				sprintf(switchto_igd, "%s", UL30VT_SWITCHTO_IGD);
-			if (!power_state_dis_off || !power_state_dis_on || !switchto_dis || !switchto_igd)
-				printk(KERN_ERR "BYO-switcheroo unable to allocate buffer for preload\n");
-		}
+	/*
+	 * Needs the scripts, so this has to wait for the preload.  The core
+	 * registers the dummy client as powered on and wouldn't turn it
+	 * back on before switching to it, so the two don't mix.
+	 */
+	if (power_off_on_load && dummy_client)
+		printk(KERN_WARNING "BYO-switcheroo: power_off_on_load "
+		       "ignored with dummy_client\n");
+	else if (power_off_on_load) {
+		byo_switcheroo_load_off.handler = &byo_switcheroo_handler;
+		byo_switcheroo_load_off.pdev = dis_dev;
+		switcheroo_load_off(&byo_switcheroo_load_off, load_time);
 	}
+
+	switcheroo_policy_init(&byo_switcheroo_policy);
 	return 0;
+
+	/* Same order as the module exit */
+err_register:
+	switcheroo_request_exit(&byo_switcheroo_request);
+	debugfs_remove_recursive(byo_switcheroo_debugfs);
+	switcheroo_reprobe_exit(&byo_switcheroo_reprobe);
+	switcheroo_energy_exit(&byo_switcheroo_energy);
+	switcheroo_stats_exit(&byo_switcheroo_stats);
+	switcheroo_backend_exit();
+	switcheroo_trace_exit(&byo_switcheroo_trace);
+	return ret;
 }
 
 static void __exit byo_switcheroo_exit(void)
 {
+	switcheroo_policy_exit(&byo_switcheroo_policy);
+	switcheroo_request_exit(&byo_switcheroo_request);
+	switcheroo_load_off_exit(&byo_switcheroo_load_off);
+	debugfs_remove_recursive(byo_switcheroo_debugfs);
+	if (!switcheroo_backend_simulated()) {
+		if (dummy_client)
+			vga_switcheroo_unregister_client(dis_dev);
+		vga_switcheroo_unregister_handler();
+	}
+	switcheroo_reprobe_exit(&byo_switcheroo_reprobe);
+	switcheroo_energy_exit(&byo_switcheroo_energy);
+	switcheroo_stats_exit(&byo_switcheroo_stats);
 	if (dummy_client)
-		vga_switcheroo_unregister_client(dis_dev);
-	vga_switcheroo_unregister_handler();
+		switcheroo_irqstat_exit(&byo_switcheroo_irqstat);
+	switcheroo_backend_exit();
+	switcheroo_trace_exit(&byo_switcheroo_trace);
 }
 
 module_init(byo_switcheroo_init);
@@ -440,6 +655,45 @@ module_param(power_state_igd_off, charp, 0644);
 module_param(power_state_dis_on, charp, 0644);
 module_param(power_state_dis_off, charp, 0644);
 
+module_param(ac_policy, charp, 0444);
+MODULE_PARM_DESC(ac_policy, "Switcheroo commands to run when AC is plugged in (eg. \"DIS\")");
+
+module_param(battery_policy, charp, 0444);
+MODULE_PARM_DESC(battery_policy, "Switcheroo commands to run when running on battery (eg. \"IGD,OFF\")");
+
+module_param(policy_debounce_ms, uint, 0644);
+MODULE_PARM_DESC(policy_debounce_ms, "Delay before acting on AC adapter events (default 100ms)");
+
+module_param(request_window_ms, uint, 0644);
+MODULE_PARM_DESC(request_window_ms, "Window in which queued switch requests are collapsed (default 50ms)");
+
+module_param(irq_warn_rate, uint, 0644);
+MODULE_PARM_DESC(irq_warn_rate, "Warn when the dummy client irq fires more than this many times a second while off (default 100, 0 to disable)");
+
+module_param(power_off_on_load, bool, 0444);
+MODULE_PARM_DESC(power_off_on_load, "Power off discrete graphics at load if no driver is bound to it");
+
+module_param(defer_reprobe, bool, 0644);
+MODULE_PARM_DESC(defer_reprobe, "Run the !nouveau_fbcon_output_poll_changed special from a workqueue");
+
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Firmware backend, \"acpi\" (default), \"record\" to log firmware calls, or \"fake\" or \"replay\" for benchmarking without the hardware");
+
+module_param(bench_p99_budget_us, uint, 0644);
+MODULE_PARM_DESC(bench_p99_budget_us, "Fail the simulated backend benchmark if any operation's 99th percentile exceeds this (default 0, no limit)");
+
+module_param(firmware_budget_ms, uint, 0644);
+MODULE_PARM_DESC(firmware_budget_ms, "Default budget for each firmware method and optional operation, logged and skipped if optional once over it (default 500ms, 0 to disable)");
+
+module_param(energy_battery, charp, 0444);
+MODULE_PARM_DESC(energy_battery, "Sample this battery's draw (eg. \"BAT0\") for per state and per transition power figures (default off)");
+
+module_param(energy_interval_ms, uint, 0644);
+MODULE_PARM_DESC(energy_interval_ms, "Battery draw sampling interval (default 1000ms)");
+
+module_param(energy_window_ms, uint, 0644);
+MODULE_PARM_DESC(energy_window_ms, "How long after a transition its energy cost is measured (default 10000ms)");
+
 MODULE_AUTHOR("Alex Williamson <alex.williamson@redhat.com>");
 MODULE_DESCRIPTION("Build-Your-Own hybrid graphics switcheroo");
 MODULE_LICENSE("GPL v2");
@@ -0,0 +1,293 @@
+/*
+ * Jprobes hack to disable i915 notifiers when the device is powered down.
+ *
+ * Copyright 2011 Red Hat, Inc
+ *
+ * Author: Alex Williamson <alex.williamson@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/module.h>
+#include <linux/acpi.h>
+#include <linux/kprobes.h>
+#include <linux/kallsyms.h>
+#include <linux/notifier.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/vga_switcheroo.h>
+#include <linux/workqueue.h>
+
+#include "switcheroo-trace.h"
+#include "switcheroo-work.h"
+
+#ifndef ACPI_VIDEO_CLASS
+#define ACPI_VIDEO_CLASS "video"
+#endif
+
+#ifndef WRITE_ONCE
+#define WRITE_ONCE(x, val) (ACCESS_ONCE(x) = (val))
+#endif
+
+/*
+ * Each gate describes one notifier i915 registers that must not reach the
+ * hardware while the device is off.  We watch the registration function to
+ * catch the notifier block as i915 hands it over, matching on the i915
+ * callback, then swap the callback for a counting stub whenever the device
+ * is switched off.  Adding another notifier is just another entry here.
+ */
+struct i915_gate {
+	const char *name;
+	const char *register_sym;
+	const char *notify_sym;
+	const char *device_class;	/* only count these ACPI bus events */
+	int (*notify)(struct notifier_block *, unsigned long, void *);
+	struct notifier_block *nb;
+	atomic_t suppressed;
+	struct jprobe jprobe;
+};
+
+static int my_notifier_register(struct notifier_block *nb);
+
+static struct i915_gate i915_gates[] = {
+	{
+		.name = "lid",
+		.register_sym = "acpi_lid_notifier_register",
+		.notify_sym = "intel_lid_notify",
+		.jprobe = { .entry = (kprobe_opcode_t *)my_notifier_register },
+	},
+	{
+		.name = "acpi-video",
+		.register_sym = "register_acpi_notifier",
+		.notify_sym = "intel_opregion_video_event",
+		/* the global ACPI chain sees every bus event */
+		.device_class = ACPI_VIDEO_CLASS,
+		.jprobe = { .entry = (kprobe_opcode_t *)my_notifier_register },
+	},
+};
+
+static bool i915_gates_resolved;
+static struct dentry *i915_jprobe_debugfs;
+static struct switcheroo_trace_user i915_jprobe_trace;
+static struct workqueue_struct *i915_jprobe_wq;
+
+static int my_gated_notify(struct notifier_block *nb, unsigned long val,
+			   void *data)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++) {
+		if (i915_gates[i].nb == nb) {
+			if (i915_gates[i].device_class &&
+			    strcmp(((struct acpi_bus_event *)data)->device_class,
+				   i915_gates[i].device_class))
+				return NOTIFY_DONE;
+			atomic_inc(&i915_gates[i].suppressed);
+			switcheroo_trace_event("suppress", i915_gates[i].name,
+					       val, 0);
+			break;
+		}
+	}
+	return NOTIFY_OK;
+}
+
+static void my_i915_switcheroo_set_state(struct pci_dev *pdev,
+					 enum vga_switcheroo_state state)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++) {
+		struct i915_gate *gate = &i915_gates[i];
+
+		if (!gate->nb) {
+			printk("Switching state, but no %s notifier block "
+			       "found\n", gate->name);
+			continue;
+		}
+
+		if (state == VGA_SWITCHEROO_ON)
+			WRITE_ONCE(gate->nb->notifier_call, gate->notify);
+		else
+			WRITE_ONCE(gate->nb->notifier_call, my_gated_notify);
+		switcheroo_trace_event("gate", gate->name, state, 0);
+	}
+
+ 	jprobe_return();
+	return; /* unreached */
+}
+
+static struct jprobe my_i915_switcheroo_set_state_jprobe = {
+	.entry = (kprobe_opcode_t *)my_i915_switcheroo_set_state
+};
+
+static void i915_register_jprobe(struct work_struct *work)
+{
+	switcheroo_work_ran(work);
+
+	if (register_jprobe(&my_i915_switcheroo_set_state_jprobe) < 0) {
+		printk("Failed to register i915 jprobe\n");
+		my_i915_switcheroo_set_state_jprobe.kp.addr = NULL;
+		i915_gates_resolved = false;
+		return;
+	}
+	printk("i915 jprobe registered\n");
+}
+
+static struct switcheroo_work i915_jprobe_register_work =
+	SWITCHEROO_WORK(i915_jprobe_register_work, i915_register_jprobe);
+
+static struct switcheroo_work *i915_jprobe_works[] = {
+	&i915_jprobe_register_work,
+	NULL
+};
+
+/* Called the first time a watched registration function runs after i915
+ * has loaded.  Until then none of the i915 symbols resolve. */
+static bool i915_gates_resolve(void)
+{
+	int i;
+
+	my_i915_switcheroo_set_state_jprobe.kp.addr =
+		(kprobe_opcode_t *)kallsyms_lookup_name("i915_switcheroo_set_state");
+	if (!my_i915_switcheroo_set_state_jprobe.kp.addr)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++)
+		i915_gates[i].notify =
+			(void *)kallsyms_lookup_name(i915_gates[i].notify_sym);
+
+	switcheroo_queue_work(i915_jprobe_wq, &i915_jprobe_register_work);
+	return true;
+}
+
+static int my_notifier_register(struct notifier_block *nb)
+{
+	int i;
+
+	if (!i915_gates_resolved) {
+		i915_gates_resolved = i915_gates_resolve();
+		if (!i915_gates_resolved)
+			goto done;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++) {
+		struct i915_gate *gate = &i915_gates[i];
+
+		if (gate->notify && nb->notifier_call == gate->notify) {
+			switcheroo_trace_event("match", gate->name, 0, 0);
+			gate->nb = nb;
+		}
+	}
+
+done:
+ 	jprobe_return();
+	return 0; /* unreached */
+}
+
+static int i915_gates_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++) {
+		struct i915_gate *gate = &i915_gates[i];
+
+		seq_printf(m, "%s %s %s %d\n", gate->name,
+			   gate->nb ? "matched" : "unmatched",
+			   gate->nb && gate->nb->notifier_call == my_gated_notify ?
+			   "gated" : "open",
+			   atomic_read(&gate->suppressed));
+	}
+	return 0;
+}
+
+static int i915_gates_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, i915_gates_show, NULL);
+}
+
+static const struct file_operations i915_gates_fops = {
+	.owner = THIS_MODULE,
+	.open = i915_gates_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int __init i915_jprobe_init(void)
+{
+	int i, ret;
+
+	i915_jprobe_wq = switcheroo_alloc_wq("i915-jprobe");
+	if (!i915_jprobe_wq)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++) {
+		struct i915_gate *gate = &i915_gates[i];
+
+		gate->jprobe.kp.addr = (kprobe_opcode_t *)
+			kallsyms_lookup_name(gate->register_sym);
+		if (!gate->jprobe.kp.addr) {
+			printk("Couldn't find %s address\n",
+			       gate->register_sym);
+			continue;
+		}
+
+		if ((ret = register_jprobe(&gate->jprobe)) < 0) {
+			printk("Failed register_jprobe for %s, %d\n",
+			       gate->register_sym, ret);
+			gate->jprobe.kp.addr = NULL;
+			continue;
+		}
+		printk("Registered i915/%s jprobe\n", gate->name);
+	}
+
+	if (!i915_gates[0].jprobe.kp.addr) {
+		for (i = 1; i < ARRAY_SIZE(i915_gates); i++)
+			if (i915_gates[i].jprobe.kp.addr)
+				unregister_jprobe(&i915_gates[i].jprobe);
+		destroy_workqueue(i915_jprobe_wq);
+		return -1;
+	}
+
+	i915_jprobe_debugfs = debugfs_create_dir("i915-jprobe", NULL);
+	if (!IS_ERR_OR_NULL(i915_jprobe_debugfs)) {
+		debugfs_create_file("gates", 0444, i915_jprobe_debugfs, NULL,
+				    &i915_gates_fops);
+		debugfs_create_file("work", 0444, i915_jprobe_debugfs,
+				    i915_jprobe_works, &switcheroo_work_fops);
+	}
+	switcheroo_trace_init(&i915_jprobe_trace, "i915-jprobe",
+			      i915_jprobe_debugfs);
+
+	return 0;
+}
+
+void __exit i915_jprobe_exit(void)
+{
+	int i;
+
+	debugfs_remove_recursive(i915_jprobe_debugfs);
+
+	for (i = 0; i < ARRAY_SIZE(i915_gates); i++)
+		if (i915_gates[i].jprobe.kp.addr)
+			unregister_jprobe(&i915_gates[i].jprobe);
+
+	/* Nothing can queue the register work now, let it finish */
+	destroy_workqueue(i915_jprobe_wq);
+
+	if (my_i915_switcheroo_set_state_jprobe.kp.addr)
+		unregister_jprobe(&my_i915_switcheroo_set_state_jprobe);
+	switcheroo_trace_exit(&i915_jprobe_trace);
+	printk("Unregistered i915 jprobes\n");
+}
+
+#ifndef SWITCHEROO_COMBINED
+module_init(i915_jprobe_init);
+module_exit(i915_jprobe_exit);
+
+MODULE_AUTHOR("Alex Williamson <alex.williamson@redhat.com>");
+MODULE_DESCRIPTION("Jprobe hack to fix i915 bugs when device is disabled");
+MODULE_LICENSE("GPL v2");
+MODULE_VERSION("0.2");
+#endif
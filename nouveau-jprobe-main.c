@@ -10,13 +10,20 @@
  * the COPYING file in the top-level directory.
  */
 
+#include <linux/moduleparam.h>
 #include <linux/module.h>
 #include <linux/interrupt.h>
+#include <linux/debugfs.h>
 #include <linux/kprobes.h>
 #include <linux/kallsyms.h>
+#include <linux/mutex.h>
 #include <linux/pci.h>
 #include <linux/workqueue.h>
 
+#include "switcheroo-irqstat.h"
+#include "switcheroo-trace.h"
+#include "switcheroo-work.h"
+
 static unsigned int nouveau_irq;
 static irqreturn_t (*nouveau_irq_handler)(int irq, void *arg);
 static unsigned long nouveau_flags;
@@ -25,6 +32,29 @@ static void *nouveau_dev;
 static struct pci_dev *nouveau_pdev;
 static int nouveau_irq_disabled;
 
+static unsigned int irq_warn_rate = 100;
+static struct dentry *nouveau_jprobe_debugfs;
+static struct switcheroo_trace_user nouveau_jprobe_trace;
+static struct workqueue_struct *nouveau_jprobe_wq;
+static DEFINE_MUTEX(nouveau_jprobe_lock);
+
+static struct switcheroo_irqstat nouveau_irqstat = {
+	.name = "nouveau-jprobe",
+	.warn_rate = &irq_warn_rate,
+};
+
+/* The discovery jprobes get unregistered from both the workqueue and module
+ * exit, make sure only one of them does it. */
+static void nouveau_unregister_jprobe(struct jprobe *jp)
+{
+	mutex_lock(&nouveau_jprobe_lock);
+	if (jp->kp.addr) {
+		unregister_jprobe(jp);
+		jp->kp.addr = NULL;
+	}
+	mutex_unlock(&nouveau_jprobe_lock);
+}
+
 static int my_nouveau_pci_suspend(struct pci_dev *pdev, pm_message_t pm_state);
 
 static struct jprobe my_nouveau_pci_suspend_jprobe = {
@@ -33,19 +63,21 @@ static struct jprobe my_nouveau_pci_suspend_jprobe = {
 
 static void unregister_pci_suspend(struct work_struct *work)
 {
-	unregister_jprobe(&my_nouveau_pci_suspend_jprobe);
-	my_nouveau_pci_suspend_jprobe.kp.addr = NULL;
+	switcheroo_work_ran(work);
+	nouveau_unregister_jprobe(&my_nouveau_pci_suspend_jprobe);
 }
 
-DECLARE_WORK(unregister_pci_suspend_work, unregister_pci_suspend);
+static struct switcheroo_work unregister_pci_suspend_work =
+	SWITCHEROO_WORK(unregister_pci_suspend_work, unregister_pci_suspend);
 
 /* This jprobe is simply to find the struct pci_dev for the nouveau card */
 static int my_nouveau_pci_suspend(struct pci_dev *pdev, pm_message_t pm_state)
 {
 	if (!nouveau_pdev) {
-		printk("Discovered nouveau pdev: %p\n", pdev);
+		switcheroo_trace_event("pci_suspend", "nouveau_pdev", 0, 0);
 		nouveau_pdev = pdev;
-		schedule_work(&unregister_pci_suspend_work);
+		switcheroo_queue_work(nouveau_jprobe_wq,
+				      &unregister_pci_suspend_work);
 	}
 
  	jprobe_return();
@@ -55,6 +87,8 @@ static int my_nouveau_pci_suspend(struct pci_dev *pdev, pm_message_t pm_state)
 /* Register the jprobe in a workqueue to get it out of interrupt context */
 static void register_pci_suspend(struct work_struct *work)
 {
+	switcheroo_work_ran(work);
+
 	if (register_jprobe(&my_nouveau_pci_suspend_jprobe) < 0) {
 		printk("Failed to register nouveau_pci_suspend jprobe\n");
 		my_nouveau_pci_suspend_jprobe.kp.addr = NULL;
@@ -63,7 +97,8 @@ static void register_pci_suspend(struct work_struct *work)
 	printk("nouveau_pci_suspend jprobe registered\n");
 }
 
-static DECLARE_WORK(register_pci_suspend_work, register_pci_suspend);
+static struct switcheroo_work register_pci_suspend_work =
+	SWITCHEROO_WORK(register_pci_suspend_work, register_pci_suspend);
 
 static int my_request_threaded_irq(unsigned int irq, irq_handler_t handler,
 				   irq_handler_t thread_fn, unsigned long flags,
@@ -75,12 +110,13 @@ static struct jprobe my_request_threaded_irq_jprobe = {
 
 static void unregister_request_threaded_irq(struct work_struct *work)
 {
-	unregister_jprobe(&my_request_threaded_irq_jprobe);
-	my_request_threaded_irq_jprobe.kp.addr = NULL;
+	switcheroo_work_ran(work);
+	nouveau_unregister_jprobe(&my_request_threaded_irq_jprobe);
 }
 
-DECLARE_WORK(unregister_request_threaded_irq_work,
-	     unregister_request_threaded_irq);
+static struct switcheroo_work unregister_request_threaded_irq_work =
+	SWITCHEROO_WORK(unregister_request_threaded_irq_work,
+			unregister_request_threaded_irq);
 
 /* Intercept calls to request_threaded_irq().  Here we can check if nouveau
  * is registered yet, finding the irq handler and suspend function.  If this
@@ -96,7 +132,8 @@ static int my_request_threaded_irq(unsigned int irq, irq_handler_t handler,
 		my_nouveau_pci_suspend_jprobe.kp.addr =
 			(void *)kallsyms_lookup_name("nouveau_pci_suspend");
 		if (my_nouveau_pci_suspend_jprobe.kp.addr)
-			schedule_work(&register_pci_suspend_work);
+			switcheroo_queue_work(nouveau_jprobe_wq,
+					      &register_pci_suspend_work);
 		else {
 			nouveau_irq_handler = NULL;
 			printk("Failed to find nouveau_pci_suspend\n");
@@ -104,12 +141,15 @@ static int my_request_threaded_irq(unsigned int irq, irq_handler_t handler,
 	}
 
 	if (nouveau_irq_handler && handler == nouveau_irq_handler) {
-		printk("Discovered nouveau irq params\n");
+		switcheroo_trace_event("request_irq", "nouveau_irq", irq, 0);
 		nouveau_irq = irq;
 		nouveau_flags = flags;
 		nouveau_name = name;
 		nouveau_dev = dev;
-		schedule_work(&unregister_request_threaded_irq_work);
+		switcheroo_irqstat_start(&nouveau_irqstat, irq,
+					 SWITCHEROO_IRQ_ON);
+		switcheroo_queue_work(nouveau_jprobe_wq,
+				      &unregister_request_threaded_irq_work);
 	}
 
  	jprobe_return();
@@ -120,21 +160,34 @@ static int my_request_threaded_irq(unsigned int irq, irq_handler_t handler,
  * a workqueue too. */
 static void my_nouveau_reenable_irq_work(struct work_struct *work)
 {
+	ktime_t start = ktime_get();
 	int ret;
 
+	switcheroo_work_ran(work);
+
 	if (!nouveau_irq_disabled)
 		return;
 
-	printk("Re-enabling nouveau irq handler\n");
 	ret = request_irq(nouveau_irq, nouveau_irq_handler,
 			  nouveau_flags, nouveau_name, nouveau_dev);
+	switcheroo_trace("irq_enable", "request_irq", nouveau_irq, ret, start);
 	if (ret < 0)
 		printk("Failed to re-request nouveau irq: %d\n", ret);
 	nouveau_irq_disabled = 0;
+	switcheroo_irqstat_set_state(&nouveau_irqstat, SWITCHEROO_IRQ_ON);
 }
 
-static DECLARE_WORK(my_nouveau_reenable_irq_register_work,
-		    my_nouveau_reenable_irq_work);
+static struct switcheroo_work my_nouveau_reenable_irq_register_work =
+	SWITCHEROO_WORK(my_nouveau_reenable_irq_register_work,
+			my_nouveau_reenable_irq_work);
+
+static struct switcheroo_work *nouveau_jprobe_works[] = {
+	&register_pci_suspend_work,
+	&unregister_pci_suspend_work,
+	&unregister_request_threaded_irq_work,
+	&my_nouveau_reenable_irq_register_work,
+	NULL
+};
 
 /* Here's where we disable and re-enable the nouveau irq handler.  We disable
  * in this function if we're going to D3hot and we setup the kretprobe handler
@@ -155,12 +208,22 @@ static int my_pci_set_power_state_pre_kprobe(struct kretprobe_instance *ri,
 #endif
 
 	if (nouveau_irq_handler && pdev == nouveau_pdev) {
-		if (state == PCI_D0)
+		if (state == PCI_D0) {
+			/* Interrupts from here until the handler is back
+			 * land on nobody */
+			if (nouveau_irq_disabled)
+				switcheroo_irqstat_set_state(&nouveau_irqstat,
+						SWITCHEROO_IRQ_TRANSITION);
 			return 0; /* call handler */
-		else if (state == PCI_D3hot && !nouveau_irq_disabled) {
-			printk("Disabling nouveau irq handler\n");
+		} else if (state == PCI_D3hot && !nouveau_irq_disabled) {
+			ktime_t start = ktime_get();
+
 			free_irq(nouveau_irq, nouveau_dev);
+			switcheroo_trace("irq_disable", "free_irq", nouveau_irq,
+					 0, start);
 			nouveau_irq_disabled = 1;
+			switcheroo_irqstat_set_state(&nouveau_irqstat,
+						     SWITCHEROO_IRQ_OFF);
 		}
 	}
 	return 1; /* don't call handler */
@@ -170,7 +233,8 @@ static int my_pci_set_power_state_kprobe(struct kretprobe_instance *ri,
 					 struct pt_regs *regs)
 {
 	if (nouveau_irq_disabled)
-		schedule_work(&my_nouveau_reenable_irq_register_work);
+		switcheroo_queue_work(nouveau_jprobe_wq,
+				      &my_nouveau_reenable_irq_register_work);
 	return 0;
 }
 
@@ -184,6 +248,19 @@ int __init nouveau_jprobe_init(void)
 {
 	int ret;
 
+	nouveau_jprobe_wq = switcheroo_alloc_wq("nouveau-jprobe");
+	if (!nouveau_jprobe_wq)
+		return -ENOMEM;
+
+	/* Accounting has to be ready before the probes can find the irq */
+	nouveau_jprobe_debugfs = debugfs_create_dir("nouveau-jprobe", NULL);
+	switcheroo_irqstat_init(&nouveau_irqstat, nouveau_jprobe_debugfs);
+	switcheroo_trace_init(&nouveau_jprobe_trace, "nouveau-jprobe",
+			      nouveau_jprobe_debugfs);
+	if (!IS_ERR_OR_NULL(nouveau_jprobe_debugfs))
+		debugfs_create_file("work", 0444, nouveau_jprobe_debugfs,
+				    nouveau_jprobe_works, &switcheroo_work_fops);
+
 	/* Register jprobe for request_threaded_irq, this is our hook to
          * find the parameters to call this ourselves and setup another
          * jprobe hook to find the pci device for nouveau. */
@@ -191,12 +268,12 @@ int __init nouveau_jprobe_init(void)
 		(kprobe_opcode_t *)kallsyms_lookup_name("request_threaded_irq");
 	if (!my_request_threaded_irq_jprobe.kp.addr) {
 		printk("Couldn't find request_threaded_irq address\n");
-		return -1;
+		goto fail;
 	}
 
 	if ((ret = register_jprobe(&my_request_threaded_irq_jprobe)) < 0) {
 		printk("Failed register_jprobe for request_irq, %d\n", ret);
-		return -1;
+		goto fail;
 	}
 
 	/* This is the long running hook that toggles the interrupt handler
@@ -205,35 +282,58 @@ int __init nouveau_jprobe_init(void)
 		(kprobe_opcode_t *)kallsyms_lookup_name("pci_set_power_state");
 	if (!my_pci_set_power_state_kretprobe.kp.addr) {
 		printk("Couldn't find pci_set_power_state address\n");
-		return -1;
+		goto fail_jprobe;
 	}
 	if ((ret = register_kretprobe(&my_pci_set_power_state_kretprobe)) < 0) {
 		printk("Failed register_kretprobe for pci_set_power_state, "
 		       "%d\n", ret);
-		return -1;
+		goto fail_jprobe;
 	}
 		
 	printk("Registered nouveau jprobe\n");
 
 	return 0;
+
+fail_jprobe:
+	unregister_jprobe(&my_request_threaded_irq_jprobe);
+fail:
+	switcheroo_trace_exit(&nouveau_jprobe_trace);
+	debugfs_remove_recursive(nouveau_jprobe_debugfs);
+	destroy_workqueue(nouveau_jprobe_wq);
+	return -1;
 }
 
 void __exit nouveau_jprobe_exit(void)
 {
+	/* Stop the probes that queue work first, then let the queue run
+	 * dry so any pending register has happened before we look at the
+	 * last discovery jprobe. */
+	nouveau_unregister_jprobe(&my_request_threaded_irq_jprobe);
 	unregister_kretprobe(&my_pci_set_power_state_kretprobe);
+	flush_workqueue(nouveau_jprobe_wq);
+	nouveau_unregister_jprobe(&my_nouveau_pci_suspend_jprobe);
+	destroy_workqueue(nouveau_jprobe_wq);
 
-	if (my_request_threaded_irq_jprobe.kp.addr)
-		unregister_jprobe(&my_request_threaded_irq_jprobe);
-	if (my_nouveau_pci_suspend_jprobe.kp.addr)
-		unregister_jprobe(&my_nouveau_pci_suspend_jprobe);
+	debugfs_remove_recursive(nouveau_jprobe_debugfs);
+	switcheroo_irqstat_exit(&nouveau_irqstat);
+	switcheroo_trace_exit(&nouveau_jprobe_trace);
 
 	printk("Unregistered nouveau jprobe\n");
 }
 
+#ifndef SWITCHEROO_COMBINED
 module_init(nouveau_jprobe_init);
 module_exit(nouveau_jprobe_exit);
 
+module_param(irq_warn_rate, uint, 0644);
+MODULE_PARM_DESC(irq_warn_rate, "Warn when the irq fires more than this many times a second while the device is off (default 100, 0 to disable)");
+
 MODULE_AUTHOR("Alex Williamson <alex.williamson@redhat.com>");
 MODULE_DESCRIPTION("Jprobe hack to fix nouveau bugs when device is disabled");
 MODULE_LICENSE("GPL v2");
 MODULE_VERSION("0.1");
+#else
+/* asus-switcheroo already has an irq_warn_rate for the dummy client */
+module_param_named(nouveau_irq_warn_rate, irq_warn_rate, uint, 0644);
+MODULE_PARM_DESC(nouveau_irq_warn_rate, "Warn when the nouveau irq fires more than this many times a second while the device is off (default 100, 0 to disable)");
+#endif
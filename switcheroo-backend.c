@@ -0,0 +1,977 @@
+/*
+ * Firmware and PCI power backends for the switcheroo handlers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/acpi.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/mutex.h>
+#include <linux/pci.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/vga_switcheroo.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+
+#include "switcheroo-backend.h"
+
+static const struct switcheroo_backend_ops switcheroo_acpi_backend = {
+	.name = "acpi",
+	.get_handle = acpi_get_handle,
+	.evaluate = acpi_evaluate_object,
+	.set_power_state = pci_set_power_state,
+};
+
+const struct switcheroo_backend_ops *switcheroo_backend =
+	&switcheroo_acpi_backend;
+
+/*
+ * Fake methods are keyed on their last path segment, "_DSM", "MXMX",
+ * "_PS3", etc.  The handle the fake hands out is the method's own entry,
+ * so byo-switcheroo's fully qualified script paths find their way back
+ * to it.  PCI power changes are charged to "D0" and "D3hot".
+ */
+#define SWITCHEROO_FAKE_METHODS 16
+
+struct switcheroo_fake_method {
+	char name[16];
+	unsigned int latency_us;
+	unsigned int fail_every;
+	unsigned int calls;
+	unsigned int failures;
+};
+
+static struct switcheroo_fake_method switcheroo_fake_methods[SWITCHEROO_FAKE_METHODS];
+static DEFINE_SPINLOCK(switcheroo_fake_lock);
+
+static struct switcheroo_fake_method *switcheroo_fake_lookup(const char *path)
+{
+	struct switcheroo_fake_method *fm = NULL;
+	const char *name = strrchr(path, '.');
+	unsigned long flags;
+	int i;
+
+	if (!name)
+		name = strrchr(path, '\\');
+	name = name ? name + 1 : path;
+
+	spin_lock_irqsave(&switcheroo_fake_lock, flags);
+	for (i = 0; i < SWITCHEROO_FAKE_METHODS; i++) {
+		struct switcheroo_fake_method *m = &switcheroo_fake_methods[i];
+
+		if (!strncmp(m->name, name, sizeof(m->name) - 1)) {
+			fm = m;
+			break;
+		}
+		if (!m->name[0]) {
+			strlcpy(m->name, name, sizeof(m->name));
+			fm = m;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&switcheroo_fake_lock, flags);
+	return fm;
+}
+
+static acpi_status switcheroo_fake_call(struct switcheroo_fake_method *fm)
+{
+	unsigned int calls;
+
+	if (!fm)
+		return AE_NOT_FOUND;
+
+	if (fm->latency_us)
+		usleep_range(fm->latency_us, fm->latency_us);
+
+	calls = ++fm->calls;
+	if (fm->fail_every && !(calls % fm->fail_every)) {
+		fm->failures++;
+		return AE_ERROR;
+	}
+	return AE_OK;
+}
+
+static acpi_status switcheroo_fake_get_handle(acpi_handle parent,
+					      acpi_string path,
+					      acpi_handle *ret)
+{
+	struct switcheroo_fake_method *fm = switcheroo_fake_lookup(path);
+
+	if (!fm)
+		return AE_NOT_FOUND;
+	*ret = (acpi_handle)fm;
+	return AE_OK;
+}
+
+static acpi_status switcheroo_fake_evaluate(acpi_handle handle,
+					    acpi_string method,
+					    struct acpi_object_list *args,
+					    struct acpi_buffer *ret)
+{
+	struct switcheroo_fake_method *fm;
+	union acpi_object *obj;
+	acpi_status status;
+
+	fm = method ? switcheroo_fake_lookup(method) : handle;
+	status = switcheroo_fake_call(fm);
+	if (ACPI_FAILURE(status) || !ret)
+		return status;
+
+	if (ret->length != ACPI_ALLOCATE_BUFFER)
+		return AE_BAD_PARAMETER;
+
+	obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+	if (!obj)
+		return AE_NO_MEMORY;
+	obj->type = ACPI_TYPE_INTEGER;
+	ret->pointer = obj;
+	ret->length = sizeof(*obj);
+	return AE_OK;
+}
+
+static int switcheroo_fake_set_power_state(struct pci_dev *pdev,
+					   pci_power_t state)
+{
+	const char *name = state == PCI_D0 ? "D0" : "D3hot";
+
+	if (ACPI_FAILURE(switcheroo_fake_call(switcheroo_fake_lookup(name))))
+		return -EIO;
+	return 0;
+}
+
+const struct switcheroo_backend_ops switcheroo_fake_backend = {
+	.name = "fake",
+	.get_handle = switcheroo_fake_get_handle,
+	.evaluate = switcheroo_fake_evaluate,
+	.set_power_state = switcheroo_fake_set_power_state,
+	.simulated = true,
+};
+
+/* name latency_us fail_every calls failures */
+static int switcheroo_fake_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	for (i = 0; i < SWITCHEROO_FAKE_METHODS; i++) {
+		struct switcheroo_fake_method *fm = &switcheroo_fake_methods[i];
+
+		if (!fm->name[0])
+			break;
+		seq_printf(m, "%s %u %u %u %u\n", fm->name, fm->latency_us,
+			   fm->fail_every, fm->calls, fm->failures);
+	}
+	return 0;
+}
+
+static int switcheroo_fake_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_fake_show, NULL);
+}
+
+/* "METHOD latency_us [fail_every]", eg. "_DSM 2000 100" */
+static ssize_t switcheroo_fake_write(struct file *file, const char __user *buf,
+				     size_t count, loff_t *ppos)
+{
+	struct switcheroo_fake_method *fm;
+	unsigned int latency_us, fail_every = 0;
+	char tmp[64], name[16];
+	size_t len = min(count, sizeof(tmp) - 1);
+
+	if (copy_from_user(tmp, buf, len))
+		return -EFAULT;
+	tmp[len] = 0;
+
+	if (sscanf(tmp, "%15s %u %u", name, &latency_us, &fail_every) < 2)
+		return -EINVAL;
+
+	fm = switcheroo_fake_lookup(name);
+	if (!fm)
+		return -ENOSPC;
+	fm->latency_us = latency_us;
+	fm->fail_every = fail_every;
+	return count;
+}
+
+static const struct file_operations switcheroo_fake_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_fake_open,
+	.read = seq_read,
+	.write = switcheroo_fake_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* The name of the method being evaluated, for keying logs and stats.
+ * Scripts evaluate the method's own handle rather than naming it. */
+static void switcheroo_method_name(acpi_handle handle, acpi_string method,
+				   char *name, size_t len)
+{
+	char single[ACPI_NAME_SIZE + 1];
+	struct acpi_buffer buf = { sizeof(single), single };
+
+	name[0] = 0;
+	if (method)
+		strlcpy(name, method, len);
+	else if (switcheroo_backend_simulated())
+		strlcpy(name, ((struct switcheroo_fake_method *)handle)->name,
+			len);
+	else if (ACPI_SUCCESS(acpi_get_name(handle, ACPI_SINGLE_NAME, &buf)))
+		strlcpy(name, single, len);
+}
+
+/*
+ * Record and replay.  The record backend is the real one, but logs every
+ * method evaluation with its arguments, result and how long it took.
+ * The log is read back as a binary file (a struct switcheroo_acpi_log
+ * followed by count records) from the debugfs acpi_log file.  Written
+ * back to the same file of a module loaded with the replay backend, the
+ * handler calls are answered in order with the recorded status, result
+ * and duration, so a handler change can be measured against the firmware
+ * timing of a model that isn't on the desk.
+ */
+#define SWITCHEROO_ACPI_LOG_MAGIC	0x4c574853	/* "SHWL" */
+#define SWITCHEROO_ACPI_LOG_VERSION	1
+#define SWITCHEROO_ACPI_LOG_ENTRIES	4096
+
+struct switcheroo_acpi_record {
+	char method[16];
+	u32 argc;
+	u32 args[4];		/* integers, buffer lengths, packed packages */
+	u32 status;
+	u32 result_type;
+	u64 result;		/* integer value or element count/length */
+	u64 duration_ns;
+};
+
+struct switcheroo_acpi_log {
+	u32 magic;
+	u32 version;
+	u32 count;
+	u32 dropped;		/* calls that didn't fit while recording */
+	struct switcheroo_acpi_record records[0];
+};
+
+static struct switcheroo_acpi_log *switcheroo_acpi_log;
+static unsigned int switcheroo_acpi_log_cursor;
+static unsigned int switcheroo_replay_misses;
+static DEFINE_MUTEX(switcheroo_acpi_log_lock);
+
+#define SWITCHEROO_ACPI_LOG_SIZE \
+	(sizeof(struct switcheroo_acpi_log) + \
+	 SWITCHEROO_ACPI_LOG_ENTRIES * sizeof(struct switcheroo_acpi_record))
+
+static u32 switcheroo_acpi_log_arg(union acpi_object *obj)
+{
+	u32 val = 0;
+	int i;
+
+	switch (obj->type) {
+	case ACPI_TYPE_INTEGER:
+		return obj->integer.value;
+	case ACPI_TYPE_BUFFER:
+		return obj->buffer.length;
+	case ACPI_TYPE_PACKAGE:
+		for (i = 0; i < obj->package.count && i < 4; i++)
+			if (obj->package.elements[i].type == ACPI_TYPE_INTEGER)
+				val |= (obj->package.elements[i].integer.value &
+					0xff) << (i * 8);
+		return val;
+	}
+	return 0;
+}
+
+/* How the log keys a call, along with the method name */
+static void switcheroo_acpi_log_args(struct acpi_object_list *args,
+				     struct switcheroo_acpi_record *rec)
+{
+	int i;
+
+	if (!args)
+		return;
+
+	rec->argc = args->count;
+	for (i = 0; i < args->count && i < 4; i++)
+		rec->args[i] = switcheroo_acpi_log_arg(&args->pointer[i]);
+}
+
+static acpi_status switcheroo_record_evaluate(acpi_handle handle,
+					      acpi_string method,
+					      struct acpi_object_list *args,
+					      struct acpi_buffer *ret)
+{
+	struct switcheroo_acpi_record *rec;
+	ktime_t start = ktime_get();
+	acpi_status status;
+
+	status = acpi_evaluate_object(handle, method, args, ret);
+
+	mutex_lock(&switcheroo_acpi_log_lock);
+	if (switcheroo_acpi_log->count == SWITCHEROO_ACPI_LOG_ENTRIES) {
+		switcheroo_acpi_log->dropped++;
+		goto out;
+	}
+	rec = &switcheroo_acpi_log->records[switcheroo_acpi_log->count++];
+	memset(rec, 0, sizeof(*rec));
+	rec->duration_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	rec->status = status;
+
+	switcheroo_method_name(handle, method, rec->method, sizeof(rec->method));
+	switcheroo_acpi_log_args(args, rec);
+
+	if (ACPI_SUCCESS(status) && ret && ret->pointer) {
+		union acpi_object *obj = ret->pointer;
+
+		rec->result_type = obj->type;
+		rec->result = switcheroo_acpi_log_arg(obj);
+	}
+out:
+	mutex_unlock(&switcheroo_acpi_log_lock);
+	return status;
+}
+
+static const struct switcheroo_backend_ops switcheroo_record_backend = {
+	.name = "record",
+	.get_handle = acpi_get_handle,
+	.evaluate = switcheroo_record_evaluate,
+	.set_power_state = pci_set_power_state,
+};
+
+/* Take the next record for this method and arguments (for _DSM, the
+ * same function), skipping any that were logged for calls the handler no
+ * longer makes */
+static acpi_status switcheroo_replay_evaluate(acpi_handle handle,
+					      acpi_string method,
+					      struct acpi_object_list *args,
+					      struct acpi_buffer *ret)
+{
+	struct switcheroo_fake_method *fm = method ?
+		switcheroo_fake_lookup(method) : handle;
+	struct switcheroo_acpi_record rec, *r;
+	union acpi_object *obj;
+	unsigned int i, count;
+
+	if (!fm)
+		return AE_NOT_FOUND;
+
+	memset(&rec, 0, sizeof(rec));
+	switcheroo_acpi_log_args(args, &rec);
+
+	mutex_lock(&switcheroo_acpi_log_lock);
+	count = min_t(u32, switcheroo_acpi_log->count,
+		      SWITCHEROO_ACPI_LOG_ENTRIES);
+	for (i = switcheroo_acpi_log_cursor; i < count; i++) {
+		r = &switcheroo_acpi_log->records[i];
+		if (!strncmp(r->method, fm->name, sizeof(r->method)) &&
+		    r->argc == rec.argc &&
+		    !memcmp(r->args, rec.args, sizeof(rec.args)))
+			break;
+	}
+	if (i == count) {
+		switcheroo_replay_misses++;
+		mutex_unlock(&switcheroo_acpi_log_lock);
+		return AE_NOT_FOUND;
+	}
+	rec = switcheroo_acpi_log->records[i];
+	switcheroo_acpi_log_cursor = i + 1;
+	mutex_unlock(&switcheroo_acpi_log_lock);
+
+	fm->calls++;
+	if (rec.duration_ns >= NSEC_PER_USEC)
+		usleep_range(div_u64(rec.duration_ns, NSEC_PER_USEC),
+			     div_u64(rec.duration_ns, NSEC_PER_USEC));
+
+	if (ACPI_FAILURE(rec.status) || !ret || !rec.result_type) {
+		if (ACPI_FAILURE(rec.status))
+			fm->failures++;
+		return rec.status;
+	}
+
+	if (ret->length != ACPI_ALLOCATE_BUFFER)
+		return AE_BAD_PARAMETER;
+
+	/* Only integer results are reproduced, others come back empty */
+	obj = kzalloc(sizeof(*obj), GFP_KERNEL);
+	if (!obj)
+		return AE_NO_MEMORY;
+	obj->type = rec.result_type;
+	if (obj->type == ACPI_TYPE_INTEGER)
+		obj->integer.value = rec.result;
+	ret->pointer = obj;
+	ret->length = sizeof(*obj);
+	return AE_OK;
+}
+
+static const struct switcheroo_backend_ops switcheroo_replay_backend = {
+	.name = "replay",
+	.get_handle = switcheroo_fake_get_handle,
+	.evaluate = switcheroo_replay_evaluate,
+	.set_power_state = switcheroo_fake_set_power_state,
+	.simulated = true,
+};
+
+static ssize_t switcheroo_acpi_log_read(struct file *file, char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	ssize_t ret;
+
+	mutex_lock(&switcheroo_acpi_log_lock);
+	ret = simple_read_from_buffer(buf, count, ppos, switcheroo_acpi_log,
+				      sizeof(*switcheroo_acpi_log) +
+				      min_t(u32, switcheroo_acpi_log->count,
+					    SWITCHEROO_ACPI_LOG_ENTRIES) *
+				      sizeof(struct switcheroo_acpi_record));
+	mutex_unlock(&switcheroo_acpi_log_lock);
+	return ret;
+}
+
+/* Loading a log to replay, starting over from its first record.  The
+ * first write has to carry the whole header, and a header that isn't
+ * ours leaves the loaded log alone. */
+static ssize_t switcheroo_acpi_log_write(struct file *file,
+					 const char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct switcheroo_acpi_log hdr;
+	ssize_t ret;
+
+	if (switcheroo_backend != &switcheroo_replay_backend)
+		return -EPERM;
+
+	if (!*ppos) {
+		if (count < sizeof(hdr))
+			return -EINVAL;
+		if (copy_from_user(&hdr, buf, sizeof(hdr)))
+			return -EFAULT;
+		if (hdr.magic != SWITCHEROO_ACPI_LOG_MAGIC ||
+		    hdr.version != SWITCHEROO_ACPI_LOG_VERSION ||
+		    hdr.count > SWITCHEROO_ACPI_LOG_ENTRIES)
+			return -EINVAL;
+	} else if (*ppos < sizeof(hdr))
+		return -EINVAL;
+
+	mutex_lock(&switcheroo_acpi_log_lock);
+	if (!*ppos) {
+		switcheroo_acpi_log_cursor = 0;
+		switcheroo_replay_misses = 0;
+	}
+	ret = simple_write_to_buffer(switcheroo_acpi_log,
+				     SWITCHEROO_ACPI_LOG_SIZE, ppos, buf,
+				     count);
+	mutex_unlock(&switcheroo_acpi_log_lock);
+	return ret;
+}
+
+static const struct file_operations switcheroo_acpi_log_fops = {
+	.owner = THIS_MODULE,
+	.read = switcheroo_acpi_log_read,
+	.write = switcheroo_acpi_log_write,
+	.llseek = default_llseek,
+};
+
+/*
+ * We can't interrupt a firmware method that loops or stalls, and the
+ * handler calls it with the switcheroo core's lock held.  What we can do
+ * is notice, and leave out what we can do without.  Every firmware call
+ * (keyed by method name, and by function for _DSM) and every optional
+ * operation gets a budget.  A watchdog armed before the call logs the
+ * method's full path as soon as the budget runs out, so a call that
+ * never comes back still shows up, and the call's final time is logged
+ * when it does.  Either way that method or operation is marked degraded
+ * and the handlers stop making it if it's optional (the LED _DSM, the
+ * output reprobe).  Per key calls, overruns, worst times, budgets and
+ * degraded state are in the debugfs firmware file.  Writing "key ms" to
+ * it sets one key's budget (0 for the default) and clears its degraded
+ * state, anything else clears all of them.
+ */
+#define SWITCHEROO_BUDGET_KEYS 16
+
+struct switcheroo_budget_stat {
+	char key[16];
+	unsigned int calls;
+	unsigned int overruns;
+	unsigned int budget_ms;		/* 0 for the module default */
+	bool degraded;
+	u64 worst_ns;
+};
+
+static struct switcheroo_budget_stat switcheroo_budget_stats[SWITCHEROO_BUDGET_KEYS];
+static DEFINE_MUTEX(switcheroo_budget_lock);
+static const char *switcheroo_budget_name;
+static unsigned int *switcheroo_budget_ms;
+
+struct switcheroo_budget_watch {
+	struct delayed_work work;
+	acpi_handle handle;
+	acpi_string method;
+	const char *key;
+	unsigned int budget_ms;
+	bool fired;
+};
+
+/* "_DSM:func" for _DSM calls, the plain method name otherwise */
+static void switcheroo_budget_key(const char *method,
+				  struct acpi_object_list *args,
+				  char *key, size_t len)
+{
+	if (!strcmp(method, "_DSM") && args && args->count > 2 &&
+	    args->pointer[2].type == ACPI_TYPE_INTEGER)
+		snprintf(key, len, "_DSM:%llu",
+			 (unsigned long long)args->pointer[2].integer.value);
+	else
+		strlcpy(key, method[0] ? method : "unknown", len);
+}
+
+/* Find or add key's entry, with switcheroo_budget_lock held.  NULL once
+ * the table is full. */
+static struct switcheroo_budget_stat *switcheroo_budget_get(const char *key)
+{
+	struct switcheroo_budget_stat *st;
+	int i;
+
+	for (i = 0; i < SWITCHEROO_BUDGET_KEYS; i++) {
+		st = &switcheroo_budget_stats[i];
+		if (!st->key[0])
+			strlcpy(st->key, key, sizeof(st->key));
+		if (!strcmp(st->key, key))
+			return st;
+	}
+	return NULL;
+}
+
+/* The key's budget in ms, 0 if it has none */
+static unsigned int switcheroo_budget_limit(const char *key)
+{
+	struct switcheroo_budget_stat *st;
+	unsigned int ms;
+
+	mutex_lock(&switcheroo_budget_lock);
+	st = switcheroo_budget_get(key);
+	ms = st && st->budget_ms ? st->budget_ms :
+	     switcheroo_budget_ms ? *switcheroo_budget_ms : 0;
+	mutex_unlock(&switcheroo_budget_lock);
+	return ms;
+}
+
+static void switcheroo_budget_degrade(const char *key)
+{
+	struct switcheroo_budget_stat *st;
+
+	mutex_lock(&switcheroo_budget_lock);
+	st = switcheroo_budget_get(key);
+	if (st)
+		st->degraded = true;
+	mutex_unlock(&switcheroo_budget_lock);
+}
+
+bool switcheroo_firmware_degraded(const char *key)
+{
+	bool degraded = false;
+	int i;
+
+	mutex_lock(&switcheroo_budget_lock);
+	for (i = 0; i < SWITCHEROO_BUDGET_KEYS; i++) {
+		if (!strcmp(switcheroo_budget_stats[i].key, key)) {
+			degraded = switcheroo_budget_stats[i].degraded;
+			break;
+		}
+	}
+	mutex_unlock(&switcheroo_budget_lock);
+	return degraded;
+}
+
+/* Count a call to key taking ns, true if it was over budget_ms */
+static bool switcheroo_budget_account(const char *key, u64 ns,
+				      unsigned int budget_ms)
+{
+	struct switcheroo_budget_stat *st;
+	bool over = budget_ms && ns > (u64)budget_ms * NSEC_PER_MSEC;
+
+	mutex_lock(&switcheroo_budget_lock);
+	st = switcheroo_budget_get(key);
+	if (st) {
+		st->calls++;
+		st->overruns += over;
+		st->degraded |= over;
+		if (ns > st->worst_ns)
+			st->worst_ns = ns;
+	}
+	mutex_unlock(&switcheroo_budget_lock);
+	return over;
+}
+
+/* Full ACPI path of the method, or key if there isn't one to be had.
+ * The caller frees *path. */
+static const char *switcheroo_budget_path(acpi_handle handle,
+					  acpi_string method, const char *key,
+					  char **path)
+{
+	struct acpi_buffer buf = { ACPI_ALLOCATE_BUFFER, NULL };
+
+	*path = NULL;
+	if (!handle || switcheroo_backend_simulated() ||
+	    ACPI_FAILURE(acpi_get_name(handle, ACPI_FULL_PATHNAME, &buf)))
+		return key;
+
+	if (method) {
+		*path = kasprintf(GFP_KERNEL, "%s.%s", (char *)buf.pointer,
+				  method);
+		kfree(buf.pointer);
+	} else
+		*path = buf.pointer;
+	return *path ? *path : key;
+}
+
+/* Runs while the method is still going */
+static void switcheroo_budget_watchdog(struct work_struct *work)
+{
+	struct switcheroo_budget_watch *w =
+		container_of(work, struct switcheroo_budget_watch, work.work);
+	char *path;
+
+	w->fired = true;
+	switcheroo_budget_degrade(w->key);
+	printk(KERN_WARNING "%s: %s still running after %u ms, skipping it from now on if optional\n",
+	       switcheroo_budget_name,
+	       switcheroo_budget_path(w->handle, w->method, w->key, &path),
+	       w->budget_ms);
+	kfree(path);
+}
+
+acpi_status switcheroo_evaluate(acpi_handle handle, acpi_string method,
+				struct acpi_object_list *args,
+				struct acpi_buffer *ret)
+{
+	struct switcheroo_budget_watch w;
+	acpi_status status;
+	ktime_t start;
+	char name[16], key[16];
+	char *path;
+	u64 ns;
+
+	switcheroo_method_name(handle, method, name, sizeof(name));
+	switcheroo_budget_key(name, args, key, sizeof(key));
+
+	w.handle = handle;
+	w.method = method;
+	w.key = key;
+	w.budget_ms = switcheroo_budget_limit(key);
+	w.fired = false;
+	INIT_DELAYED_WORK_ONSTACK(&w.work, switcheroo_budget_watchdog);
+	if (w.budget_ms)
+		schedule_delayed_work(&w.work, msecs_to_jiffies(w.budget_ms));
+
+	start = ktime_get();
+	status = switcheroo_backend->evaluate(handle, method, args, ret);
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	cancel_delayed_work_sync(&w.work);
+	destroy_timer_on_stack(&w.work.timer);
+	destroy_work_on_stack(&w.work.work);
+
+	if (switcheroo_budget_account(key, ns, w.budget_ms) || w.fired) {
+		printk(KERN_WARNING "%s: %s took %llu ms, over the %u ms budget\n",
+		       switcheroo_budget_name,
+		       switcheroo_budget_path(handle, method, key, &path),
+		       div_u64(ns, NSEC_PER_MSEC), w.budget_ms);
+		kfree(path);
+	}
+	return status;
+}
+
+void switcheroo_budget_op(const char *key, ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	unsigned int budget_ms = switcheroo_budget_limit(key);
+
+	if (switcheroo_budget_account(key, ns, budget_ms))
+		printk(KERN_WARNING "%s: %s took %llu ms, over the %u ms budget, skipping it from now on\n",
+		       switcheroo_budget_name, key,
+		       div_u64(ns, NSEC_PER_MSEC), budget_ms);
+}
+
+/* key calls overruns worst_us budget_ms degraded */
+static int switcheroo_budget_show(struct seq_file *m, void *unused)
+{
+	int i;
+
+	seq_printf(m, "budget_ms %u\n", *switcheroo_budget_ms);
+
+	mutex_lock(&switcheroo_budget_lock);
+	for (i = 0; i < SWITCHEROO_BUDGET_KEYS; i++) {
+		struct switcheroo_budget_stat *st = &switcheroo_budget_stats[i];
+
+		if (!st->key[0])
+			break;
+		seq_printf(m, "%s %u %u %llu %u %d\n", st->key, st->calls,
+			   st->overruns, div_u64(st->worst_ns, NSEC_PER_USEC),
+			   st->budget_ms ? st->budget_ms : *switcheroo_budget_ms,
+			   st->degraded);
+	}
+	mutex_unlock(&switcheroo_budget_lock);
+	return 0;
+}
+
+static int switcheroo_budget_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_budget_show, NULL);
+}
+
+static ssize_t switcheroo_budget_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct switcheroo_budget_stat *st;
+	char tmp[32], key[16];
+	size_t len = min(count, sizeof(tmp) - 1);
+	unsigned int ms;
+	int i;
+
+	if (copy_from_user(tmp, buf, len))
+		return -EFAULT;
+	tmp[len] = 0;
+
+	mutex_lock(&switcheroo_budget_lock);
+	if (sscanf(tmp, "%15s %u", key, &ms) == 2) {
+		st = switcheroo_budget_get(key);
+		if (st) {
+			st->budget_ms = ms;
+			st->degraded = false;
+		}
+	} else {
+		for (i = 0; i < SWITCHEROO_BUDGET_KEYS; i++)
+			switcheroo_budget_stats[i].degraded = false;
+	}
+	mutex_unlock(&switcheroo_budget_lock);
+	return count;
+}
+
+static const struct file_operations switcheroo_budget_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_budget_open,
+	.read = seq_read,
+	.write = switcheroo_budget_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const char * const switcheroo_bench_names[] = {
+	"switchto_dis", "switchto_igd", "power_off", "power_on", "request",
+};
+
+static int switcheroo_bench_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int switcheroo_bench_op(struct switcheroo_bench *b, int op)
+{
+	switch (op) {
+	case SWITCHEROO_BENCH_DIS:
+		return b->handler->switchto(VGA_SWITCHEROO_DIS);
+	case SWITCHEROO_BENCH_IGD:
+		return b->handler->switchto(VGA_SWITCHEROO_IGD);
+	case SWITCHEROO_BENCH_OFF:
+		return b->handler->power_state(VGA_SWITCHEROO_DIS,
+					       VGA_SWITCHEROO_OFF);
+	case SWITCHEROO_BENCH_ON:
+		return b->handler->power_state(VGA_SWITCHEROO_DIS,
+					       VGA_SWITCHEROO_ON);
+	default:
+		return b->req ? switcheroo_request_bench(b) : 0;
+	}
+}
+
+static int switcheroo_bench_run(struct switcheroo_bench *b,
+				unsigned int cycles)
+{
+	ktime_t begin = ktime_get();
+	unsigned int i;
+	int op, ret = 0;
+	u64 *samples;
+
+	samples = vmalloc(sizeof(u64) * cycles * SWITCHEROO_BENCH_OPS);
+	if (!samples)
+		return -ENOMEM;
+
+	mutex_lock(&b->lock);
+	b->errors = 0;
+
+	for (i = 0; i < cycles; i++) {
+		for (op = 0; op < SWITCHEROO_BENCH_OPS; op++) {
+			ktime_t start = ktime_get();
+
+			if (switcheroo_bench_op(b, op))
+				b->errors++;
+			samples[op * cycles + i] =
+				ktime_to_ns(ktime_sub(ktime_get(), start));
+		}
+		cond_resched();
+	}
+
+	b->cycles = cycles;
+	b->total_ns = ktime_to_ns(ktime_sub(ktime_get(), begin));
+
+	for (op = 0; op < SWITCHEROO_BENCH_OPS; op++) {
+		u64 *s = samples + op * cycles;
+
+		sort(s, cycles, sizeof(u64), switcheroo_bench_cmp, NULL);
+		b->pct_ns[op][0] = s[cycles * 50 / 100];
+		b->pct_ns[op][1] = s[cycles * 90 / 100];
+		b->pct_ns[op][2] = s[cycles * 99 / 100];
+		b->pct_ns[op][3] = s[cycles - 1];
+
+		if (*b->p99_budget_us &&
+		    b->pct_ns[op][2] > (u64)*b->p99_budget_us * NSEC_PER_USEC)
+			ret = -ETIME;
+	}
+	if (b->errors)
+		ret = -EIO;
+	mutex_unlock(&b->lock);
+
+	vfree(samples);
+	return ret;
+}
+
+/* Per operation: p50, p90, p99 and max latency (us) */
+static int switcheroo_bench_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_bench *b = m->private;
+	int op;
+
+	mutex_lock(&b->lock);
+	seq_printf(m, "backend %s\ncycles %u\nerrors %u\ntotal_ms %llu\n",
+		   switcheroo_backend->name, b->cycles, b->errors,
+		   div_u64(b->total_ns, NSEC_PER_MSEC));
+	if (switcheroo_backend == &switcheroo_replay_backend)
+		seq_printf(m, "replay_misses %u\n", switcheroo_replay_misses);
+	for (op = 0; op < SWITCHEROO_BENCH_OPS; op++)
+		seq_printf(m, "%s %llu %llu %llu %llu\n",
+			   switcheroo_bench_names[op],
+			   div_u64(b->pct_ns[op][0], NSEC_PER_USEC),
+			   div_u64(b->pct_ns[op][1], NSEC_PER_USEC),
+			   div_u64(b->pct_ns[op][2], NSEC_PER_USEC),
+			   div_u64(b->pct_ns[op][3], NSEC_PER_USEC));
+	mutex_unlock(&b->lock);
+	return 0;
+}
+
+static int switcheroo_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_bench_show, inode->i_private);
+}
+
+static ssize_t switcheroo_bench_write(struct file *file,
+				      const char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	char tmp[16];
+	size_t len = min(count, sizeof(tmp) - 1);
+	unsigned long cycles;
+	int ret;
+
+	if (copy_from_user(tmp, buf, len))
+		return -EFAULT;
+	tmp[len] = 0;
+
+	cycles = simple_strtoul(tmp, NULL, 0);
+	if (!cycles || cycles > SWITCHEROO_BENCH_MAX_CYCLES)
+		return -EINVAL;
+
+	ret = switcheroo_bench_run(m->private, cycles);
+	return ret ? ret : count;
+}
+
+static const struct file_operations switcheroo_bench_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_bench_open,
+	.read = seq_read,
+	.write = switcheroo_bench_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static const struct switcheroo_backend_ops *switcheroo_backends[] = {
+	&switcheroo_acpi_backend,
+	&switcheroo_fake_backend,
+	&switcheroo_record_backend,
+	&switcheroo_replay_backend,
+};
+
+void switcheroo_backend_select(const char *name, const char *backend,
+			       unsigned int *budget_ms)
+{
+	const struct switcheroo_backend_ops *ops = NULL;
+	int i;
+
+	switcheroo_budget_name = name;
+	switcheroo_budget_ms = budget_ms;
+	if (!backend)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(switcheroo_backends); i++)
+		if (!strcmp(backend, switcheroo_backends[i]->name))
+			ops = switcheroo_backends[i];
+
+	if (!ops) {
+		printk(KERN_WARNING "%s: unknown backend %s, using %s\n",
+		       name, backend, switcheroo_acpi_backend.name);
+		return;
+	}
+
+	if (ops == &switcheroo_record_backend ||
+	    ops == &switcheroo_replay_backend) {
+		switcheroo_acpi_log = vzalloc(SWITCHEROO_ACPI_LOG_SIZE);
+		if (!switcheroo_acpi_log) {
+			printk(KERN_WARNING "%s: no memory for %s log, using "
+			       "%s\n", name, ops->name,
+			       switcheroo_acpi_backend.name);
+			return;
+		}
+		switcheroo_acpi_log->magic = SWITCHEROO_ACPI_LOG_MAGIC;
+		switcheroo_acpi_log->version = SWITCHEROO_ACPI_LOG_VERSION;
+	}
+
+	printk(KERN_INFO "%s: using %s firmware backend\n", name, ops->name);
+	switcheroo_backend = ops;
+}
+
+void switcheroo_backend_init(struct switcheroo_bench *b,
+			     struct vga_switcheroo_handler *handler,
+			     struct dentry *dir)
+{
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_file("firmware", 0600, dir, NULL,
+			    &switcheroo_budget_fops);
+	if (switcheroo_acpi_log)
+		debugfs_create_file("acpi_log", 0600, dir, NULL,
+				    &switcheroo_acpi_log_fops);
+
+	if (!switcheroo_backend_simulated())
+		return;
+
+	b->handler = handler;
+	mutex_init(&b->lock);
+	if (switcheroo_backend == &switcheroo_fake_backend)
+		debugfs_create_file("fake", 0600, dir, NULL,
+				    &switcheroo_fake_fops);
+	debugfs_create_file("bench", 0600, dir, b, &switcheroo_bench_fops);
+}
+
+void switcheroo_backend_exit(void)
+{
+	switcheroo_backend = &switcheroo_acpi_backend;
+	vfree(switcheroo_acpi_log);
+}
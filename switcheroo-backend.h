@@ -0,0 +1,118 @@
+/*
+ * Firmware and PCI power backends for the switcheroo handlers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_BACKEND_H
+#define _SWITCHEROO_BACKEND_H
+
+#include <linux/acpi.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/pci.h>
+#include <linux/types.h>
+#include <linux/vga_switcheroo.h>
+
+struct dentry;
+
+/*
+ * The handlers reach the firmware and the PCI power state only through
+ * these calls, so the real ACPI/PCI ones can be swapped for a fake that
+ * doesn't need the laptop.  The fake answers every method with integer
+ * 0 after a configurable delay and can fail every Nth call, which is
+ * enough to drive the handler code through thousands of switch cycles
+ * in a VM and see where the time goes.
+ */
+struct switcheroo_backend_ops {
+	const char *name;
+	acpi_status (*get_handle)(acpi_handle parent, acpi_string path,
+				  acpi_handle *ret);
+	acpi_status (*evaluate)(acpi_handle handle, acpi_string method,
+				struct acpi_object_list *args,
+				struct acpi_buffer *ret);
+	int (*set_power_state)(struct pci_dev *pdev, pci_power_t state);
+	bool simulated;		/* no hardware behind it */
+};
+
+extern const struct switcheroo_backend_ops *switcheroo_backend;
+extern const struct switcheroo_backend_ops switcheroo_fake_backend;
+
+static inline acpi_status switcheroo_get_handle(acpi_handle parent,
+						acpi_string path,
+						acpi_handle *ret)
+{
+	return switcheroo_backend->get_handle(parent, path, ret);
+}
+
+static inline int switcheroo_set_power_state(struct pci_dev *pdev,
+					     pci_power_t state)
+{
+	return switcheroo_backend->set_power_state(pdev, state);
+}
+
+static inline bool switcheroo_backend_simulated(void)
+{
+	return switcheroo_backend->simulated;
+}
+
+/*
+ * Switch cycle benchmark, only offered on the simulated backends.  Each cycle
+ * calls the handler directly, the way the switcheroo core would: switch
+ * to DIS and back to IGD, then power the discrete device off and on.
+ * Last, "DIS,ON" and "IGD,ON" through the request queue, which must
+ * leave the inactive device on.
+ * Writing a cycle count to the bench file runs it; the write fails with
+ * -EIO if any operation failed and -ETIME if any operation's 99th
+ * percentile is over p99_budget_us, so a script can use it as a
+ * regression check.
+ */
+enum {
+	SWITCHEROO_BENCH_DIS,
+	SWITCHEROO_BENCH_IGD,
+	SWITCHEROO_BENCH_OFF,
+	SWITCHEROO_BENCH_ON,
+	SWITCHEROO_BENCH_REQUEST,
+	SWITCHEROO_BENCH_OPS,
+};
+
+#define SWITCHEROO_BENCH_MAX_CYCLES 100000
+
+struct switcheroo_request;
+
+struct switcheroo_bench {
+	struct vga_switcheroo_handler *handler;
+	struct switcheroo_request *req;
+	unsigned int *p99_budget_us;
+	struct mutex lock;
+	unsigned int cycles;
+	unsigned int errors;
+	u64 total_ns;
+	u64 pct_ns[SWITCHEROO_BENCH_OPS][4];	/* p50, p90, p99, max */
+};
+
+/* Whether key has gone over its budget since the last clear */
+bool switcheroo_firmware_degraded(const char *key);
+acpi_status switcheroo_evaluate(acpi_handle handle, acpi_string method,
+				struct acpi_object_list *args,
+				struct acpi_buffer *ret);
+/* Time an optional operation that isn't a firmware call against key's
+ * budget.  There's no watchdog, these don't hang the way firmware can. */
+void switcheroo_budget_op(const char *key, ktime_t start);
+
+/* Pick the backend by name, before anything touches the firmware */
+void switcheroo_backend_select(const char *name, const char *backend,
+			       unsigned int *budget_ms);
+/* Everyone gets the firmware budget file, simulated backends the
+ * benchmark, fake its control file and record and replay the log */
+void switcheroo_backend_init(struct switcheroo_bench *b,
+			     struct vga_switcheroo_handler *handler,
+			     struct dentry *dir);
+/* After debugfs is gone */
+void switcheroo_backend_exit(void);
+
+/* In switcheroo-common.c, queues the bench's requests */
+int switcheroo_request_bench(struct switcheroo_bench *b);
+
+#endif /* _SWITCHEROO_BACKEND_H */
@@ -0,0 +1,94 @@
+/*
+ * asus-switcheroo, nouveau-jprobe and i915-jprobe as a single module
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+/*
+ * Built with "make combined".  The modprobe.d install lines otherwise fork
+ * a modprobe per module from the initramfs, each doing its own lookup and
+ * load, just to have the handler registered and the hooks in place before
+ * nouveau and i915 come up.  Here that's one load and the order is fixed:
+ * the handler (with the dummy client, if asked for) first, then the
+ * nouveau hooks, then the i915 hooks, and the reverse on unload.  Each
+ * piece can be left out with its parameter, and one failing to load
+ * doesn't stop the others, same as with separate modules.  The helpers
+ * they share are linked in once, so there's one flight recorder, which
+ * an oops dumps once, and one set of backend and irq counting state.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/module.h>
+#include <linux/ktime.h>
+
+int asus_switcheroo_init(void);
+void asus_switcheroo_exit(void);
+int nouveau_jprobe_init(void);
+void nouveau_jprobe_exit(void);
+int i915_jprobe_init(void);
+void i915_jprobe_exit(void);
+
+static bool handler = true;
+static bool nouveau_hooks = true;
+static bool i915_hooks = true;
+
+static bool handler_loaded, nouveau_loaded, i915_loaded;
+
+static bool __init switcheroo_combined_load(const char *name, bool enable,
+					    int (*init)(void))
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	if (!enable)
+		return false;
+
+	ret = init();
+	printk(KERN_INFO "asus-switcheroo-all: %s %s (%lld us)\n", name,
+	       ret ? "failed" : "loaded",
+	       ktime_to_us(ktime_sub(ktime_get(), start)));
+	return !ret;
+}
+
+static int __init switcheroo_combined_init(void)
+{
+	handler_loaded = switcheroo_combined_load("asus-switcheroo", handler,
+						  asus_switcheroo_init);
+	nouveau_loaded = switcheroo_combined_load("nouveau-jprobe",
+						  nouveau_hooks,
+						  nouveau_jprobe_init);
+	i915_loaded = switcheroo_combined_load("i915-jprobe", i915_hooks,
+					       i915_jprobe_init);
+
+	if (!handler_loaded && !nouveau_loaded && !i915_loaded)
+		return -ENODEV;
+	return 0;
+}
+
+static void __exit switcheroo_combined_exit(void)
+{
+	if (i915_loaded)
+		i915_jprobe_exit();
+	if (nouveau_loaded)
+		nouveau_jprobe_exit();
+	if (handler_loaded)
+		asus_switcheroo_exit();
+}
+
+module_init(switcheroo_combined_init);
+module_exit(switcheroo_combined_exit);
+
+module_param(handler, bool, 0444);
+MODULE_PARM_DESC(handler, "Load the Asus switcheroo handler (default 1)");
+
+module_param(nouveau_hooks, bool, 0444);
+MODULE_PARM_DESC(nouveau_hooks, "Load the nouveau jprobes (default 1)");
+
+module_param(i915_hooks, bool, 0444);
+MODULE_PARM_DESC(i915_hooks, "Load the i915 jprobes (default 1)");
+
+MODULE_AUTHOR("Alex Williamson <alex.williamson@redhat.com>");
+MODULE_DESCRIPTION("Asus hybrid graphics switcheroo with nouveau and i915 jprobes");
+MODULE_LICENSE("GPL v2");
+MODULE_VERSION("0.2");
@@ -0,0 +1,1122 @@
+/*
+ * Helpers shared by the switcheroo handler modules
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/acpi.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/kallsyms.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pci.h>
+#include <linux/power_supply.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/suspend.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vga_switcheroo.h>
+#include <linux/workqueue.h>
+#include <acpi/acpi_bus.h>
+
+#include "switcheroo-common.h"
+
+/*
+ * vga_switcheroo has no in-kernel interface for requesting a switch, only
+ * the debugfs switch file.  Find the write handler behind that file and
+ * feed it the same commands userspace would.  That way the core takes its
+ * own lock and drives the clients and our handler in the usual order, and
+ * debugfs doesn't even need to be mounted.
+ */
+static ssize_t (*switcheroo_debugfs_write)(struct file *, const char __user *,
+					   size_t, loff_t *);
+
+static int switcheroo_core_command(const char *cmd)
+{
+	mm_segment_t old_fs;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	if (!switcheroo_debugfs_write) {
+		switcheroo_debugfs_write = (void *)
+			kallsyms_lookup_name("vga_switcheroo_debugfs_write");
+		if (!switcheroo_debugfs_write) {
+			printk("Can't hook to vga_switcheroo_debugfs_write\n");
+			return -ENOENT;
+		}
+	}
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = switcheroo_debugfs_write(NULL, (const char __user *)cmd,
+				       strlen(cmd), &pos);
+	set_fs(old_fs);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* The core refuses every command with -EINVAL until it's active (our
+ * handler and both clients registered) and quietly ignores ones it
+ * doesn't know, so an unknown one tells us which without doing anything */
+static bool switcheroo_core_inactive(void)
+{
+	return switcheroo_core_command("PING") == -EINVAL;
+}
+
+/* How long the AC policy waits for the core to get both its clients */
+#define SWITCHEROO_POLICY_RETRY_MS 1000
+
+static void switcheroo_policy_apply(struct switcheroo_policy *p,
+				    const char *cmds)
+{
+	const char *s = cmds;
+	char cmd[16];
+
+	while (*s) {
+		int len = strcspn(s, ",");
+
+		if (len && len < sizeof(cmd)) {
+			memcpy(cmd, s, len);
+			cmd[len] = 0;
+			switcheroo_request_queue(p->req, cmd, true);
+		}
+		s += len;
+		if (*s)
+			s++;
+	}
+}
+
+static void switcheroo_policy_work(struct work_struct *work)
+{
+	struct switcheroo_policy *p = container_of(work,
+						   struct switcheroo_policy,
+						   work.work);
+	int online = power_supply_is_system_supplied() > 0;
+	const char *cmds = online ? p->ac : p->battery;
+
+	if (p->suspended || online == p->online)
+		return;
+
+	/* Nothing to switch yet, p->online stays as is so we come back */
+	if (cmds && !switcheroo_backend_simulated() &&
+	    switcheroo_core_inactive()) {
+		schedule_delayed_work(&p->work,
+				      msecs_to_jiffies(SWITCHEROO_POLICY_RETRY_MS));
+		return;
+	}
+
+	p->online = online;
+	if (!cmds)
+		return;
+
+	printk(KERN_INFO "%s: %s, applying policy \"%s\" %lld us after event\n",
+	       p->name, online ? "on AC" : "on battery", cmds,
+	       ktime_to_us(ktime_sub(ktime_get(), p->event_time)));
+	switcheroo_policy_apply(p, cmds);
+}
+
+static void switcheroo_policy_kick(struct switcheroo_policy *p)
+{
+	p->event_time = ktime_get();
+	cancel_delayed_work(&p->work);
+	schedule_delayed_work(&p->work, msecs_to_jiffies(*p->debounce_ms));
+}
+
+static int switcheroo_policy_acpi_notify(struct notifier_block *nb,
+					 unsigned long val, void *data)
+{
+	struct switcheroo_policy *p = container_of(nb, struct switcheroo_policy,
+						   acpi_nb);
+	struct acpi_bus_event *event = data;
+
+	if (strcmp(event->device_class, "ac_adapter"))
+		return NOTIFY_DONE;
+
+	if (!p->suspended)
+		switcheroo_policy_kick(p);
+
+	return NOTIFY_OK;
+}
+
+/*
+ * Don't let a plug event start a switch underneath suspend, and look at
+ * the supply again on resume since it may have changed while we slept.
+ */
+static int switcheroo_policy_pm_notify(struct notifier_block *nb,
+				       unsigned long val, void *unused)
+{
+	struct switcheroo_policy *p = container_of(nb, struct switcheroo_policy,
+						   pm_nb);
+
+	switch (val) {
+	case PM_SUSPEND_PREPARE:
+	case PM_HIBERNATION_PREPARE:
+		p->suspended = true;
+		cancel_delayed_work_sync(&p->work);
+		break;
+	case PM_POST_SUSPEND:
+	case PM_POST_HIBERNATION:
+		p->suspended = false;
+		p->online = -1;
+		switcheroo_policy_kick(p);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+void switcheroo_policy_init(struct switcheroo_policy *p)
+{
+	if (!p->ac && !p->battery)
+		return;
+
+	/* Unknown, so whatever we load on gets its policy applied */
+	p->online = -1;
+	INIT_DELAYED_WORK(&p->work, switcheroo_policy_work);
+	p->acpi_nb.notifier_call = switcheroo_policy_acpi_notify;
+	p->pm_nb.notifier_call = switcheroo_policy_pm_notify;
+	register_acpi_notifier(&p->acpi_nb);
+	register_pm_notifier(&p->pm_nb);
+
+	printk(KERN_INFO "%s: AC policy \"%s\", battery policy \"%s\"\n",
+	       p->name, p->ac ? p->ac : "", p->battery ? p->battery : "");
+	switcheroo_policy_kick(p);
+}
+
+void switcheroo_policy_exit(struct switcheroo_policy *p)
+{
+	if (!p->acpi_nb.notifier_call)
+		return;
+
+	unregister_pm_notifier(&p->pm_nb);
+	unregister_acpi_notifier(&p->acpi_nb);
+	cancel_delayed_work_sync(&p->work);
+}
+
+static void switcheroo_load_off_restore(struct switcheroo_load_off *l)
+{
+	l->handler->power_state(VGA_SWITCHEROO_DIS, VGA_SWITCHEROO_ON);
+	switcheroo_set_power_state(l->pdev, PCI_D0);
+	pci_restore_state(l->pdev);
+	l->off = false;
+}
+
+#ifdef BUS_NOTIFY_BIND_DRIVER
+static int switcheroo_load_off_notify(struct notifier_block *nb,
+				      unsigned long action, void *data)
+{
+	struct switcheroo_load_off *l = container_of(nb,
+						     struct switcheroo_load_off,
+						     nb);
+
+	if (action != BUS_NOTIFY_BIND_DRIVER || !l->off ||
+	    to_pci_dev(data) != l->pdev)
+		return NOTIFY_DONE;
+
+	printk(KERN_INFO "%s: powering on discrete graphics for %s\n",
+	       l->name, dev_name(&l->pdev->dev));
+	switcheroo_load_off_restore(l);
+	return NOTIFY_OK;
+}
+#endif
+
+void switcheroo_load_off(struct switcheroo_load_off *l,
+			 ktime_t load_time)
+{
+	int ret;
+
+	if (!l->pdev || l->pdev->driver) {
+		printk(KERN_INFO "%s: discrete graphics driver already bound, "
+		       "leaving it on\n", l->name);
+		return;
+	}
+
+	pci_save_state(l->pdev);
+	switcheroo_set_power_state(l->pdev, PCI_D3hot);
+	ret = l->handler->power_state(VGA_SWITCHEROO_DIS, VGA_SWITCHEROO_OFF);
+	if (ret) {
+		printk(KERN_WARNING "%s: failed to power off discrete "
+		       "graphics: %d\n", l->name, ret);
+		switcheroo_set_power_state(l->pdev, PCI_D0);
+		pci_restore_state(l->pdev);
+		return;
+	}
+	l->off = true;
+
+#ifdef BUS_NOTIFY_BIND_DRIVER
+	l->nb.notifier_call = switcheroo_load_off_notify;
+	bus_register_notifier(&pci_bus_type, &l->nb);
+#endif
+
+	printk(KERN_INFO "%s: discrete graphics off %lld us after module load\n",
+	       l->name, ktime_to_us(ktime_sub(ktime_get(), load_time)));
+}
+
+void switcheroo_load_off_exit(struct switcheroo_load_off *l)
+{
+#ifdef BUS_NOTIFY_BIND_DRIVER
+	if (l->nb.notifier_call)
+		bus_unregister_notifier(&pci_bus_type, &l->nb);
+#endif
+	if (l->off)
+		switcheroo_load_off_restore(l);
+}
+
+static bool switcheroo_dummy_held(struct switcheroo_dummy *d)
+{
+	return d->pdev->driver != NULL;
+}
+
+bool switcheroo_dummy_can_switch(struct switcheroo_dummy *d)
+{
+	if (switcheroo_dummy_held(d))
+		return false;
+
+	d->start = ktime_get();
+	return true;
+}
+
+void switcheroo_dummy_switched(struct switcheroo_dummy *d, int id)
+{
+	if (!ktime_to_ns(d->start))
+		return;
+
+	d->switch_ns[id == VGA_SWITCHEROO_DIS] =
+		ktime_to_ns(ktime_sub(ktime_get(), d->start));
+}
+
+void switcheroo_dummy_done(struct switcheroo_dummy *d, int off_id)
+{
+	switcheroo_dummy_switched(d, off_id == VGA_SWITCHEROO_IGD ?
+				  VGA_SWITCHEROO_DIS : VGA_SWITCHEROO_IGD);
+	d->start = ktime_set(0, 0);
+}
+
+static int switcheroo_dummy_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_dummy *d = m->private;
+	struct pci_driver *drv = d->pdev->driver;
+
+	seq_printf(m, "driver %s\nheld %d\nlast_igd_us %llu\n"
+		   "last_dis_us %llu\nround_trip_us %llu\n",
+		   drv ? drv->name : "none", switcheroo_dummy_held(d),
+		   div_u64(d->switch_ns[0], NSEC_PER_USEC),
+		   div_u64(d->switch_ns[1], NSEC_PER_USEC),
+		   div_u64(d->switch_ns[0] + d->switch_ns[1], NSEC_PER_USEC));
+	return 0;
+}
+
+static int switcheroo_dummy_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_dummy_show, inode->i_private);
+}
+
+static const struct file_operations switcheroo_dummy_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_dummy_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void switcheroo_dummy_init(struct switcheroo_dummy *d,
+			   struct pci_dev *pdev, struct dentry *dir)
+{
+	d->pdev = pdev;
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("dummy", 0444, dir, d,
+				    &switcheroo_dummy_fops);
+}
+
+static void switcheroo_reprobe_run(struct switcheroo_reprobe *r)
+{
+	ktime_t start = ktime_get();
+
+	r->reprobe();
+	r->reprobe_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	switcheroo_budget_op("reprobe", start);
+}
+
+static void switcheroo_reprobe_work(struct work_struct *work)
+{
+	switcheroo_reprobe_run(container_of(work, struct switcheroo_reprobe,
+					    work));
+}
+
+void switcheroo_reprobe_request(struct switcheroo_reprobe *r)
+{
+	/* Optional, left out once it's been over its budget */
+	if (!r->reprobe || switcheroo_firmware_degraded("reprobe"))
+		return;
+
+	atomic_inc(&r->requests);
+	if (!*r->defer)
+		switcheroo_reprobe_run(r);
+	else if (!schedule_work(&r->work))
+		atomic_inc(&r->coalesced);
+}
+
+void switcheroo_reprobe_switched(struct switcheroo_reprobe *r,
+				 ktime_t start)
+{
+	r->switch_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+}
+
+static int switcheroo_reprobe_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_reprobe *r = m->private;
+
+	seq_printf(m, "defer %d\nrequests %d\ncoalesced %d\n"
+		   "last_switch_us %llu\nlast_reprobe_us %llu\n",
+		   *r->defer, atomic_read(&r->requests),
+		   atomic_read(&r->coalesced),
+		   div_u64(r->switch_ns, NSEC_PER_USEC),
+		   div_u64(r->reprobe_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static int switcheroo_reprobe_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_reprobe_show, inode->i_private);
+}
+
+static const struct file_operations switcheroo_reprobe_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_reprobe_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void switcheroo_reprobe_init(struct switcheroo_reprobe *r,
+			     struct dentry *dir)
+{
+	INIT_WORK(&r->work, switcheroo_reprobe_work);
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("reprobe", 0444, dir, r,
+				    &switcheroo_reprobe_fops);
+}
+
+void switcheroo_reprobe_exit(struct switcheroo_reprobe *r)
+{
+	if (r->work.func)
+		cancel_work_sync(&r->work);
+}
+
+static const char * const switcheroo_stat_names[SWITCHEROO_STATS][3] = {
+	[SWITCHEROO_STAT_IGD_POWER] = { "igd_power", "off", "on" },
+	[SWITCHEROO_STAT_DIS_POWER] = { "dis_power", "off", "on" },
+	[SWITCHEROO_STAT_MUX] = { "mux", "igd", "dis" },
+	[SWITCHEROO_STAT_DUMMY] = { "dummy", "d3hot", "d0" },
+};
+
+static int switcheroo_energy_prop(struct power_supply *psy,
+				  enum power_supply_property prop,
+				  union power_supply_propval *val)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	return power_supply_get_property(psy, prop, val);
+#else
+	return psy->get_property(psy, prop, val);
+#endif
+}
+
+/* Present rate in uW, batteries that only report current get it
+ * multiplied out by voltage */
+static s64 switcheroo_energy_read(struct switcheroo_energy *e)
+{
+	union power_supply_propval status, val, volt;
+
+	if (switcheroo_energy_prop(e->psy, POWER_SUPPLY_PROP_STATUS, &status) ||
+	    status.intval != POWER_SUPPLY_STATUS_DISCHARGING)
+		return -EAGAIN;
+
+	if (!switcheroo_energy_prop(e->psy, POWER_SUPPLY_PROP_POWER_NOW, &val))
+		return abs(val.intval);
+
+	if (!switcheroo_energy_prop(e->psy, POWER_SUPPLY_PROP_CURRENT_NOW,
+				    &val) &&
+	    !switcheroo_energy_prop(e->psy, POWER_SUPPLY_PROP_VOLTAGE_NOW,
+				    &volt))
+		return div_s64((s64)abs(val.intval) * volt.intval, 1000000);
+
+	return -ENODEV;
+}
+
+/* Called with the energy lock held */
+static void switcheroo_energy_finish(struct switcheroo_energy *e)
+{
+	struct switcheroo_energy_trans *t = &e->trans[e->which][e->to];
+
+	e->following = false;
+	if (!e->after_samples || e->before_uw < 0)
+		return;
+
+	t->count++;
+	t->before_uw += e->before_uw;
+	t->after_uw += div64_u64(e->after_sum_uw, e->after_samples);
+	t->excess_uj += e->excess_uj;
+}
+
+static void switcheroo_energy_work(struct work_struct *work)
+{
+	struct switcheroo_energy *e = container_of(work,
+						   struct switcheroo_energy,
+						   work.work);
+	s64 uw = switcheroo_energy_read(e);
+	unsigned long flags;
+	ktime_t now;
+	int i;
+
+	spin_lock_irqsave(&e->lock, flags);
+	now = ktime_get();
+	if (uw < 0) {
+		e->skipped++;
+		e->last_uw = -1;
+		e->following = false;
+		goto out;
+	}
+
+	e->samples++;
+	for (i = 0; i < SWITCHEROO_STATS; i++) {
+		e->sum_uw[i][e->state[i]] += uw;
+		e->count[i][e->state[i]]++;
+	}
+
+	if (e->following) {
+		s64 us = ktime_to_us(ktime_sub(now, e->last_time));
+
+		e->after_sum_uw += uw;
+		e->after_samples++;
+		e->excess_uj += div_s64((uw - e->before_uw) * us,
+					USEC_PER_SEC);
+		if (ktime_to_ms(ktime_sub(now, e->since)) >= *e->window_ms)
+			switcheroo_energy_finish(e);
+	}
+
+	e->last_uw = uw;
+	e->last_time = now;
+out:
+	spin_unlock_irqrestore(&e->lock, flags);
+
+	/* Not discharging (or no rate), the next AC adapter or battery
+	 * event starts us again */
+	if (uw >= 0)
+		schedule_delayed_work(&e->work,
+				      msecs_to_jiffies(max(*e->interval_ms,
+							   100U)));
+}
+
+static int switcheroo_energy_acpi_notify(struct notifier_block *nb,
+					 unsigned long val, void *data)
+{
+	struct switcheroo_energy *e = container_of(nb, struct switcheroo_energy,
+						   acpi_nb);
+	struct acpi_bus_event *event = data;
+
+	if (strcmp(event->device_class, "ac_adapter") &&
+	    strcmp(event->device_class, "battery"))
+		return NOTIFY_DONE;
+
+	schedule_delayed_work(&e->work, 0);
+	return NOTIFY_OK;
+}
+
+/* A transition cuts short any window still open for the last one */
+static void switcheroo_energy_transition(struct switcheroo_energy *e,
+					 int which, int state)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&e->lock, flags);
+	e->state[which] = state;
+	if (e->following)
+		switcheroo_energy_finish(e);
+
+	e->following = true;
+	e->which = which;
+	e->to = state;
+	e->since = e->last_time = ktime_get();
+	e->before_uw = e->last_uw;
+	e->after_sum_uw = 0;
+	e->after_samples = 0;
+	e->excess_uj = 0;
+	spin_unlock_irqrestore(&e->lock, flags);
+}
+
+/*
+ * <thing>.<state>_mw: average draw while in that state, then per
+ * transition into a state, <thing>.to_<state>: count, average draw
+ * before and after (mW) and total energy over the before draw (mJ)
+ */
+static int switcheroo_energy_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_energy *e = m->private;
+	struct switcheroo_energy_trans trans[SWITCHEROO_STATS][2];
+	u64 sum_uw[SWITCHEROO_STATS][2], count[SWITCHEROO_STATS][2];
+	u64 samples, skipped;
+	unsigned long flags;
+	int i, j;
+
+	spin_lock_irqsave(&e->lock, flags);
+	memcpy(trans, e->trans, sizeof(trans));
+	memcpy(sum_uw, e->sum_uw, sizeof(sum_uw));
+	memcpy(count, e->count, sizeof(count));
+	samples = e->samples;
+	skipped = e->skipped;
+	spin_unlock_irqrestore(&e->lock, flags);
+
+	seq_printf(m, "battery %s\nsamples %llu\nskipped %llu\n",
+		   *e->battery, samples, skipped);
+	for (i = 0; i < SWITCHEROO_STATS; i++) {
+		const char * const *name = switcheroo_stat_names[i];
+
+		for (j = 0; j < 2; j++)
+			if (count[i][j])
+				seq_printf(m, "%s.%s_mw %llu\n", name[0],
+					   name[1 + j],
+					   div64_u64(sum_uw[i][j],
+						     count[i][j] * 1000));
+		for (j = 0; j < 2; j++) {
+			struct switcheroo_energy_trans *t = &trans[i][j];
+
+			if (!t->count)
+				continue;
+			seq_printf(m, "%s.to_%s %llu %llu %llu %lld\n", name[0],
+				   name[1 + j], t->count,
+				   div64_u64(t->before_uw, t->count * 1000),
+				   div64_u64(t->after_uw, t->count * 1000),
+				   div_s64(t->excess_uj, 1000));
+		}
+	}
+	return 0;
+}
+
+static int switcheroo_energy_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_energy_show, inode->i_private);
+}
+
+static const struct file_operations switcheroo_energy_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_energy_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void switcheroo_energy_exit(struct switcheroo_energy *e)
+{
+	if (!e->psy)
+		return;
+
+	unregister_acpi_notifier(&e->acpi_nb);
+	cancel_delayed_work_sync(&e->work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	power_supply_put(e->psy);
+#endif
+	e->psy = NULL;
+}
+
+/* Only one set of stats per module */
+static struct switcheroo_stats *switcheroo_status_stats;
+
+void switcheroo_stats_charge(struct switcheroo_residency *r,
+			     ktime_t now)
+{
+	r->time_ns[r->state] += ktime_to_ns(ktime_sub(now, r->since));
+	r->since = now;
+}
+
+/* Called with the stats lock held, which serializes writers */
+static void switcheroo_stats_publish(struct switcheroo_stats *st, ktime_t now)
+{
+	struct switcheroo_status_page *page = st->page;
+	int i;
+
+	if (!page)
+		return;
+
+	page->seq++;
+	smp_wmb();
+	page->transition_seq = st->transition_seq;
+	page->update_ns = ktime_to_ns(now);
+	for (i = 0; i < SWITCHEROO_STATS; i++) {
+		struct switcheroo_residency *r = &st->res[i];
+
+		page->res[i].state = r->state;
+		page->res[i].since_ns = ktime_to_ns(r->since);
+		page->res[i].time_ns[0] = r->time_ns[0];
+		page->res[i].time_ns[1] = r->time_ns[1];
+		page->res[i].transitions = r->transitions;
+		page->res[i].last_ns = r->last_ns;
+	}
+	smp_wmb();
+	page->seq++;
+}
+
+void switcheroo_stats_update(struct switcheroo_stats *st, int which,
+			     int state, ktime_t start)
+{
+	struct switcheroo_residency *r = &st->res[which];
+	unsigned long flags;
+	bool changed = false;
+	ktime_t now;
+
+	/* now must not predate another updater's since */
+	spin_lock_irqsave(&st->lock, flags);
+	now = ktime_get();
+	switcheroo_stats_charge(r, now);
+	r->last_ns = ktime_to_ns(ktime_sub(now, start));
+	r->seen = true;
+	if (r->state != !!state) {
+		r->state = !!state;
+		r->transitions++;
+		st->transition_seq++;
+		changed = true;
+	}
+	switcheroo_stats_publish(st, now);
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	if (changed && st->energy)
+		switcheroo_energy_transition(st->energy, which, !!state);
+}
+
+static int switcheroo_stats_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_stats *st = m->private;
+	struct switcheroo_residency res[SWITCHEROO_STATS];
+	unsigned long flags;
+	ktime_t now;
+	int i;
+
+	spin_lock_irqsave(&st->lock, flags);
+	now = ktime_get();
+	for (i = 0; i < SWITCHEROO_STATS; i++)
+		switcheroo_stats_charge(&st->res[i], now);
+	memcpy(res, st->res, sizeof(res));
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	seq_printf(m, "timestamp_ns %lld\n", ktime_to_ns(now));
+	for (i = 0; i < SWITCHEROO_STATS; i++) {
+		const char * const *name = switcheroo_stat_names[i];
+
+		seq_printf(m, "%s.current %s\n", name[0], name[1 + res[i].state]);
+		seq_printf(m, "%s.%s_ns %llu\n", name[0], name[1],
+			   res[i].time_ns[0]);
+		seq_printf(m, "%s.%s_ns %llu\n", name[0], name[2],
+			   res[i].time_ns[1]);
+		seq_printf(m, "%s.transitions %llu\n", name[0],
+			   res[i].transitions);
+		seq_printf(m, "%s.last_ns %llu\n", name[0], res[i].last_ns);
+	}
+	return 0;
+}
+
+static int switcheroo_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_stats_show, inode->i_private);
+}
+
+static const struct file_operations switcheroo_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int switcheroo_status_mmap(struct file *file,
+				  struct vm_area_struct *vma)
+{
+	struct switcheroo_stats *st = switcheroo_status_stats;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE)
+		return -EINVAL;
+
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	return remap_pfn_range(vma, vma->vm_start,
+			       virt_to_phys(st->page) >> PAGE_SHIFT,
+			       PAGE_SIZE, vma->vm_page_prot);
+}
+
+static const struct file_operations switcheroo_status_fops = {
+	.owner = THIS_MODULE,
+	.mmap = switcheroo_status_mmap,
+};
+
+void switcheroo_stats_init(struct switcheroo_stats *st,
+			   const char *name, struct dentry *dir)
+{
+	unsigned long flags;
+	ktime_t now;
+	int i;
+
+	spin_lock_init(&st->lock);
+	spin_lock_irqsave(&st->lock, flags);
+	now = ktime_get();
+	for (i = 0; i < SWITCHEROO_STATS; i++) {
+		st->res[i].state = i != SWITCHEROO_STAT_MUX;
+		st->res[i].since = now;
+	}
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("residency", 0444, dir, st,
+				    &switcheroo_stats_fops);
+
+	st->page = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!st->page) {
+		printk(KERN_WARNING "%s: no memory for status page\n", name);
+		return;
+	}
+	st->page->version = SWITCHEROO_STATUS_VERSION;
+	spin_lock_irqsave(&st->lock, flags);
+	switcheroo_stats_publish(st, ktime_get());
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	switcheroo_status_stats = st;
+	st->misc.minor = MISC_DYNAMIC_MINOR;
+	st->misc.name = name;
+	st->misc.fops = &switcheroo_status_fops;
+	if (misc_register(&st->misc)) {
+		printk(KERN_WARNING "%s: failed to register status device\n",
+		       name);
+		st->misc.fops = NULL;
+	}
+}
+
+void switcheroo_stats_exit(struct switcheroo_stats *st)
+{
+	if (st->misc.fops)
+		misc_deregister(&st->misc);
+	free_page((unsigned long)st->page);
+}
+
+void switcheroo_energy_init(struct switcheroo_energy *e,
+			    struct switcheroo_stats *st,
+			    struct dentry *dir)
+{
+	unsigned long flags;
+	int i;
+
+	if (!*e->battery)
+		return;
+
+	e->psy = power_supply_get_by_name(*e->battery);
+	if (!e->psy) {
+		printk(KERN_WARNING "%s: no power supply %s, not sampling "
+		       "battery draw\n", e->name, *e->battery);
+		return;
+	}
+
+	spin_lock_init(&e->lock);
+	spin_lock_irqsave(&st->lock, flags);
+	for (i = 0; i < SWITCHEROO_STATS; i++)
+		e->state[i] = st->res[i].state;
+	spin_unlock_irqrestore(&st->lock, flags);
+	e->last_uw = -1;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+	INIT_DEFERRABLE_WORK(&e->work, switcheroo_energy_work);
+#else
+	INIT_DELAYED_WORK_DEFERRABLE(&e->work, switcheroo_energy_work);
+#endif
+	e->acpi_nb.notifier_call = switcheroo_energy_acpi_notify;
+	register_acpi_notifier(&e->acpi_nb);
+	st->energy = e;
+
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("energy", 0444, dir, e,
+				    &switcheroo_energy_fops);
+	schedule_delayed_work(&e->work, 0);
+}
+
+/*
+ * On the simulated backends the handler isn't registered with the core,
+ * so do with it what the core would: power the target up if it's off,
+ * switch, then power the old device off (the core's stage 2), and send
+ * power commands to whichever device is inactive.
+ */
+static int switcheroo_request_simulate(struct switcheroo_request *r,
+				       const char *cmd)
+{
+	struct vga_switcheroo_handler *h = r->handler;
+	struct switcheroo_stats *st = r->stats;
+	unsigned long flags;
+	int dis, to, on[2], ret = 0;
+
+	if (!h)
+		return -ENODEV;
+
+	spin_lock_irqsave(&st->lock, flags);
+	dis = st->res[SWITCHEROO_STAT_MUX].state;
+	on[VGA_SWITCHEROO_IGD] = st->res[SWITCHEROO_STAT_IGD_POWER].state;
+	on[VGA_SWITCHEROO_DIS] = st->res[SWITCHEROO_STAT_DIS_POWER].state;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	mutex_lock(&r->core_lock);
+	if (!strcmp(cmd, "IGD") || !strcmp(cmd, "DIS")) {
+		to = strcmp(cmd, "DIS") ? VGA_SWITCHEROO_IGD :
+					  VGA_SWITCHEROO_DIS;
+		if (!on[to])
+			ret |= h->power_state(to, VGA_SWITCHEROO_ON);
+		ret |= h->switchto(to);
+		ret |= h->power_state(to == VGA_SWITCHEROO_DIS ?
+				      VGA_SWITCHEROO_IGD : VGA_SWITCHEROO_DIS,
+				      VGA_SWITCHEROO_OFF);
+	} else if (!strcmp(cmd, "ON") || !strcmp(cmd, "OFF"))
+		ret = h->power_state(dis ? VGA_SWITCHEROO_IGD :
+					   VGA_SWITCHEROO_DIS,
+				     strcmp(cmd, "ON") ? VGA_SWITCHEROO_OFF :
+							 VGA_SWITCHEROO_ON);
+	mutex_unlock(&r->core_lock);
+	return ret ? -EIO : 0;
+}
+
+static void switcheroo_request_run(struct switcheroo_request *r,
+				   const char *cmd)
+{
+	int ret = switcheroo_backend_simulated() ?
+		  switcheroo_request_simulate(r, cmd) :
+		  switcheroo_core_command(cmd);
+
+	if (ret)
+		printk(KERN_WARNING "%s: switcheroo command %s failed: %d\n",
+		       r->name, cmd, ret);
+	atomic_inc(&r->executed);
+}
+
+static void switcheroo_request_work(struct work_struct *work)
+{
+	struct switcheroo_request *r = container_of(work,
+						    struct switcheroo_request,
+						    work.work);
+	struct switcheroo_stats *st = r->stats;
+	const char *mux, *power;
+	unsigned long flags;
+	int mux_state, power_state[2];
+	bool mux_seen;
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (r->suspended) {
+		spin_unlock_irqrestore(&r->lock, flags);
+		return;
+	}
+	mux = r->mux;
+	power = r->power;
+	r->mux = r->power = NULL;
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	spin_lock_irqsave(&st->lock, flags);
+	mux_seen = st->res[SWITCHEROO_STAT_MUX].seen;
+	mux_state = st->res[SWITCHEROO_STAT_MUX].state;
+	power_state[0] = st->res[SWITCHEROO_STAT_DIS_POWER].state;
+	power_state[1] = st->res[SWITCHEROO_STAT_IGD_POWER].state;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	/* We only guess where the mux starts out, don't trust the guess */
+	if (mux) {
+		if (!mux_seen || mux_state != !strcmp(mux, "DIS")) {
+			switcheroo_request_run(r, mux);
+
+			/* The switch powered off the device that was active */
+			spin_lock_irqsave(&st->lock, flags);
+			mux_state = st->res[SWITCHEROO_STAT_MUX].state;
+			power_state[0] =
+				st->res[SWITCHEROO_STAT_DIS_POWER].state;
+			power_state[1] =
+				st->res[SWITCHEROO_STAT_IGD_POWER].state;
+			spin_unlock_irqrestore(&st->lock, flags);
+		} else
+			atomic_inc(&r->absorbed);
+	}
+
+	/* Power applies to whichever device the mux leaves inactive */
+	if (power) {
+		if (power_state[mux_state] != !strcmp(power, "ON"))
+			switcheroo_request_run(r, power);
+		else
+			atomic_inc(&r->absorbed);
+	}
+}
+
+void switcheroo_request_queue(struct switcheroo_request *r,
+			      const char *cmd, bool now)
+{
+	const char **slot = NULL;
+	unsigned long flags;
+	bool suspended;
+
+	if (!strcmp(cmd, "IGD"))
+		slot = &r->mux, cmd = "IGD";
+	else if (!strcmp(cmd, "DIS"))
+		slot = &r->mux, cmd = "DIS";
+	else if (!strcmp(cmd, "ON"))
+		slot = &r->power, cmd = "ON";
+	else if (!strcmp(cmd, "OFF"))
+		slot = &r->power, cmd = "OFF";
+
+	atomic_inc(&r->requests);
+	if (!slot) {
+		switcheroo_request_run(r, cmd);
+		return;
+	}
+
+	spin_lock_irqsave(&r->lock, flags);
+	if (*slot)
+		atomic_inc(&r->absorbed);
+	*slot = cmd;
+	suspended = r->suspended;
+	spin_unlock_irqrestore(&r->lock, flags);
+
+	if (suspended)
+		return;
+
+	if (now || !*r->window_ms) {
+		cancel_delayed_work_sync(&r->work);
+		switcheroo_request_work(&r->work.work);
+	} else
+		schedule_delayed_work(&r->work,
+				      msecs_to_jiffies(*r->window_ms));
+}
+
+static int switcheroo_request_pm_notify(struct notifier_block *nb,
+					unsigned long val, void *unused)
+{
+	struct switcheroo_request *r = container_of(nb,
+						    struct switcheroo_request,
+						    pm_nb);
+	unsigned long flags;
+	bool pending;
+
+	switch (val) {
+	case PM_SUSPEND_PREPARE:
+	case PM_HIBERNATION_PREPARE:
+		spin_lock_irqsave(&r->lock, flags);
+		r->suspended = true;
+		spin_unlock_irqrestore(&r->lock, flags);
+		cancel_delayed_work_sync(&r->work);
+		break;
+	case PM_POST_SUSPEND:
+	case PM_POST_HIBERNATION:
+		spin_lock_irqsave(&r->lock, flags);
+		r->suspended = false;
+		pending = r->mux || r->power;
+		spin_unlock_irqrestore(&r->lock, flags);
+		if (pending)
+			schedule_delayed_work(&r->work, 0);
+		break;
+	}
+	return NOTIFY_DONE;
+}
+
+static ssize_t switcheroo_request_read(struct file *file, char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct switcheroo_request *r = file->private_data;
+	char tmp[96];
+	int len;
+
+	len = snprintf(tmp, sizeof(tmp), "requests %d\nabsorbed %d\n"
+		       "executed %d\n", atomic_read(&r->requests),
+		       atomic_read(&r->absorbed), atomic_read(&r->executed));
+	return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+static ssize_t switcheroo_request_write(struct file *file,
+					const char __user *buf,
+					size_t count, loff_t *ppos)
+{
+	struct switcheroo_request *r = file->private_data;
+	char cmd[16];
+	size_t len = min(count, sizeof(cmd) - 1);
+
+	if (copy_from_user(cmd, buf, len))
+		return -EFAULT;
+	cmd[len] = 0;
+	cmd[strcspn(cmd, "\n")] = 0;
+
+	switcheroo_request_queue(r, cmd, false);
+	return count;
+}
+
+static int switcheroo_request_open(struct inode *inode, struct file *file)
+{
+	file->private_data = inode->i_private;
+	return 0;
+}
+
+static const struct file_operations switcheroo_request_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_request_open,
+	.read = switcheroo_request_read,
+	.write = switcheroo_request_write,
+};
+
+void switcheroo_request_init(struct switcheroo_request *r,
+			     struct dentry *dir)
+{
+	spin_lock_init(&r->lock);
+	mutex_init(&r->core_lock);
+	INIT_DELAYED_WORK(&r->work, switcheroo_request_work);
+	r->pm_nb.notifier_call = switcheroo_request_pm_notify;
+	register_pm_notifier(&r->pm_nb);
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("request", 0600, dir, r,
+				    &switcheroo_request_fops);
+}
+
+/*
+ * Bench case: "DIS" then "ON" collapsed into one run, as an AC policy of
+ * "DIS,ON" queues them.  The switch powers the IGD off, so the ON must
+ * still go through and leave it on.  Then the same back to IGD.
+ */
+int switcheroo_request_bench(struct switcheroo_bench *b)
+{
+	struct switcheroo_request *r = b->req;
+	struct switcheroo_stats *st = r->stats;
+	unsigned long flags;
+	bool igd_on, dis_on;
+
+	switcheroo_request_queue(r, "DIS", false);
+	switcheroo_request_queue(r, "ON", true);
+	spin_lock_irqsave(&st->lock, flags);
+	igd_on = st->res[SWITCHEROO_STAT_IGD_POWER].state;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	switcheroo_request_queue(r, "IGD", false);
+	switcheroo_request_queue(r, "ON", true);
+	spin_lock_irqsave(&st->lock, flags);
+	dis_on = st->res[SWITCHEROO_STAT_DIS_POWER].state;
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	return igd_on && dis_on ? 0 : -EIO;
+}
+
+void switcheroo_request_simulated(struct switcheroo_request *r,
+				  struct switcheroo_bench *b)
+{
+	if (!switcheroo_backend_simulated() || !b->handler)
+		return;
+
+	r->handler = b->handler;
+	b->req = r;
+}
+
+void switcheroo_request_exit(struct switcheroo_request *r)
+{
+	if (!r->work.work.func)
+		return;
+
+	unregister_pm_notifier(&r->pm_nb);
+	cancel_delayed_work_sync(&r->work);
+}
@@ -0,0 +1,251 @@
+/*
+ * Helpers shared by the switcheroo handler modules
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_COMMON_H
+#define _SWITCHEROO_COMMON_H
+
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/notifier.h>
+#include <linux/pci.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/vga_switcheroo.h>
+#include <linux/workqueue.h>
+
+#include "switcheroo-backend.h"
+#include "switcheroo-status.h"
+
+struct dentry;
+
+/*
+ * AC adapter policy.  The ac driver passes its plug/unplug notifications
+ * down the ACPI notifier chain, so we get to see them as soon as the
+ * firmware raises them.  Bounces are absorbed by restarting the debounce
+ * timer on every event, then the command list for the resulting supply
+ * state (eg. "DIS" or "IGD,OFF") is queued as switcheroo requests.  The
+ * policy for the supply we load on is applied too, once the core has
+ * both its clients.
+ */
+struct switcheroo_policy {
+	const char *name;
+	struct switcheroo_request *req;
+	char *ac;
+	char *battery;
+	unsigned int *debounce_ms;
+	int online;
+	bool suspended;
+	ktime_t event_time;
+	struct delayed_work work;
+	struct notifier_block acpi_nb;
+	struct notifier_block pm_nb;
+};
+
+void switcheroo_policy_init(struct switcheroo_policy *p);
+void switcheroo_policy_exit(struct switcheroo_policy *p);
+
+/*
+ * Power the discrete GPU off from module init instead of waiting for
+ * userspace to echo OFF to the switch file.  Only done when no driver is
+ * bound to it yet.  If a driver does come along later we have to give it
+ * powered up hardware, so watch for the bind and turn it back on first.
+ */
+struct switcheroo_load_off {
+	const char *name;
+	struct vga_switcheroo_handler *handler;
+	struct pci_dev *pdev;
+	bool off;
+	struct notifier_block nb;
+};
+
+void switcheroo_load_off(struct switcheroo_load_off *l, ktime_t load_time);
+void switcheroo_load_off_exit(struct switcheroo_load_off *l);
+
+/*
+ * The dummy client stands in for a driver that doesn't know about
+ * vga_switcheroo (nvidia).  We can't ask it whether it's done with the
+ * device, and an unused module can still have the hardware running, so
+ * we refuse to switch away while any driver is bound to it.  Once it's
+ * unbound, switching back to IGD saves its state and drops it to D3hot
+ * like any other client.  Each switch is timed from the core's can_switch check
+ * until the handler has powered the old device off, the last thing the
+ * core does for a switch.
+ */
+struct switcheroo_dummy {
+	struct pci_dev *pdev;
+	ktime_t start;
+	u64 switch_ns[2];	/* last switch to IGD, DIS */
+};
+
+bool switcheroo_dummy_can_switch(struct switcheroo_dummy *d);
+/* Called at the end of both the client set_state and handler switchto,
+ * so a switch that leaves the old device on still has a time */
+void switcheroo_dummy_switched(struct switcheroo_dummy *d, int id);
+/* The handler has powered off_id down, the switch to the other one is
+ * done.  Anything after this isn't part of a switch. */
+void switcheroo_dummy_done(struct switcheroo_dummy *d, int off_id);
+void switcheroo_dummy_init(struct switcheroo_dummy *d, struct pci_dev *pdev,
+			   struct dentry *dir);
+
+/*
+ * Output reprobe after switching to the discrete device.  Probing the
+ * connectors means DDC/EDID reads, which we'd rather not do while the
+ * switcheroo core holds its lock, so optionally push it to a workqueue
+ * once the mux is switched.  Requests made while one is still pending
+ * fold into that one.
+ */
+struct switcheroo_reprobe {
+	void (*reprobe)(void);
+	bool *defer;
+	atomic_t requests;
+	atomic_t coalesced;
+	u64 switch_ns;
+	u64 reprobe_ns;
+	struct work_struct work;
+};
+
+void switcheroo_reprobe_request(struct switcheroo_reprobe *r);
+void switcheroo_reprobe_switched(struct switcheroo_reprobe *r, ktime_t start);
+void switcheroo_reprobe_init(struct switcheroo_reprobe *r, struct dentry *dir);
+void switcheroo_reprobe_exit(struct switcheroo_reprobe *r);
+
+/*
+ * Residency and transition counts for each thing we switch.  Every
+ * handler and dummy client call reports the state it leaves things in,
+ * when it started, and the time since the last report is charged to the
+ * previous state.  The debugfs file is one "key value" pair per line,
+ * times in ns, and only ever grows new keys, so samples can be diffed by
+ * key.  The SWITCHEROO_STAT_ indexes are in switcheroo-status.h.
+ */
+
+/*
+ * Optional battery draw sampling, to put a number of watts on each state
+ * and each transition.  The battery's present rate is read from its
+ * power_supply every interval_ms while discharging and each sample is
+ * added to the current state of every switched thing, giving an average
+ * draw per state.  On AC the rate says nothing about what we draw, so
+ * sampling stops until an AC adapter or battery event comes down the
+ * ACPI notifier chain, and the timer is deferrable so it never wakes an
+ * idle CPU just for us.  Transitions
+ * never read the battery themselves, that can mean a slow firmware call;
+ * they start following the samples that come after, for window_ms, and
+ * charge the draw over the last sample taken before the transition as
+ * that transition's energy cost.  Batteries only refresh the rate every
+ * few seconds, so windows should cover several of those.
+ */
+struct switcheroo_energy_trans {
+	u64 count;
+	u64 before_uw;
+	u64 after_uw;
+	s64 excess_uj;
+};
+
+struct switcheroo_energy {
+	const char *name;
+	char **battery;
+	unsigned int *interval_ms;
+	unsigned int *window_ms;
+	struct power_supply *psy;
+	spinlock_t lock;
+	struct delayed_work work;
+	struct notifier_block acpi_nb;
+	u64 samples;
+	u64 skipped;
+	s64 last_uw;
+	ktime_t last_time;
+	int state[SWITCHEROO_STATS];
+	u64 sum_uw[SWITCHEROO_STATS][2];
+	u64 count[SWITCHEROO_STATS][2];
+	/* The transition being followed, if any */
+	bool following;
+	int which;
+	int to;
+	ktime_t since;
+	s64 before_uw;
+	u64 after_sum_uw;
+	u64 after_samples;
+	s64 excess_uj;
+	struct switcheroo_energy_trans trans[SWITCHEROO_STATS][2];
+};
+
+/*
+ * The same numbers are also published in a single page that monitors can
+ * mmap read-only from /dev/<module>, so sampling costs no syscalls and
+ * never takes our lock.  The layout and the seq protocol readers follow
+ * are in switcheroo-status.h.
+ */
+
+struct switcheroo_residency {
+	int state;
+	bool seen;
+	u64 transitions;
+	u64 time_ns[2];
+	u64 last_ns;
+	ktime_t since;
+};
+
+struct switcheroo_stats {
+	spinlock_t lock;
+	u64 transition_seq;
+	struct switcheroo_residency res[SWITCHEROO_STATS];
+	struct switcheroo_status_page *page;
+	struct miscdevice misc;
+	struct switcheroo_energy *energy;
+};
+
+void switcheroo_stats_charge(struct switcheroo_residency *r, ktime_t now);
+void switcheroo_stats_update(struct switcheroo_stats *st, int which,
+			     int state, ktime_t start);
+/* Both devices come out of boot powered, with the mux assumed on IGD */
+void switcheroo_stats_init(struct switcheroo_stats *st, const char *name,
+			   struct dentry *dir);
+void switcheroo_stats_exit(struct switcheroo_stats *st);
+
+/* After switcheroo_stats_init, sampling starts from the states it set */
+void switcheroo_energy_init(struct switcheroo_energy *e,
+			    struct switcheroo_stats *st, struct dentry *dir);
+void switcheroo_energy_exit(struct switcheroo_energy *e);
+
+/*
+ * Switch requests written to our debugfs request file are held for a
+ * short window and collapsed to the last mux target (IGD/DIS) and the
+ * last power request for the inactive device (ON/OFF).  The AC policy
+ * has already debounced its own and skips the window.  Only the net
+ * change is then passed to the switcheroo core, and nothing at all if
+ * that's where we already are.  Anything else (DDIS, MIGD, ...) goes
+ * straight through.  Nothing is passed on between suspend prepare and
+ * resume; whatever is still pending then goes through after resume.
+ */
+struct switcheroo_request {
+	const char *name;
+	unsigned int *window_ms;
+	struct switcheroo_stats *stats;
+	struct vga_switcheroo_handler *handler;	/* simulated backends */
+	struct mutex core_lock;		/* and the core's lock for them */
+	spinlock_t lock;
+	const char *mux;
+	const char *power;
+	bool suspended;
+	atomic_t requests;
+	atomic_t absorbed;
+	atomic_t executed;
+	struct delayed_work work;
+	struct notifier_block pm_nb;
+};
+
+void switcheroo_request_queue(struct switcheroo_request *r, const char *cmd,
+			      bool now);
+void switcheroo_request_init(struct switcheroo_request *r, struct dentry *dir);
+/* After switcheroo_backend_init, on the simulated backends requests go
+ * to the bench's handler and the bench gets the request case */
+void switcheroo_request_simulated(struct switcheroo_request *r,
+				  struct switcheroo_bench *b);
+void switcheroo_request_exit(struct switcheroo_request *r);
+
+#endif /* _SWITCHEROO_COMMON_H */
@@ -0,0 +1,161 @@
+/*
+ * Interrupt accounting for the discrete GPU across power states
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/kallsyms.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+#include "switcheroo-irqstat.h"
+
+static const char * const switcheroo_irq_state_names[] = {
+	"on", "off", "transition",
+};
+
+static unsigned int (*switcheroo_kstat_irqs)(unsigned int irq);
+
+/* Charge interrupts and time since the last sample to the current state */
+static void switcheroo_irqstat_sample(struct switcheroo_irqstat *s)
+{
+	unsigned int count = switcheroo_kstat_irqs(s->irq);
+	ktime_t now = ktime_get();
+
+	s->count[s->state] += count - s->last_count;
+	s->time_ns[s->state] += ktime_to_ns(ktime_sub(now, s->last_time));
+	s->last_count = count;
+	s->last_time = now;
+}
+
+static void switcheroo_irqstat_watch(struct work_struct *work)
+{
+	struct switcheroo_irqstat *s = container_of(work,
+						    struct switcheroo_irqstat,
+						    watch.work);
+	unsigned long flags;
+	unsigned int count;
+	int state;
+
+	spin_lock_irqsave(&s->lock, flags);
+	state = s->state;
+	count = switcheroo_kstat_irqs(s->irq);
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (state == SWITCHEROO_IRQ_ON || !*s->warn_rate)
+		return;
+
+	if (count - s->watch_count > *s->warn_rate)
+		printk(KERN_WARNING "%s: irq %u fired %u times in the last "
+		       "second while %s\n", s->name, s->irq,
+		       count - s->watch_count,
+		       switcheroo_irq_state_names[state]);
+
+	s->watch_count = count;
+	schedule_delayed_work(&s->watch, HZ);
+}
+
+void switcheroo_irqstat_start(struct switcheroo_irqstat *s,
+			      unsigned int irq, int state)
+{
+	unsigned long flags;
+
+	if (!switcheroo_kstat_irqs)
+		return;
+
+	spin_lock_irqsave(&s->lock, flags);
+	s->irq = irq;
+	s->state = state;
+	s->last_count = switcheroo_kstat_irqs(irq);
+	s->last_time = ktime_get();
+	spin_unlock_irqrestore(&s->lock, flags);
+}
+
+void switcheroo_irqstat_set_state(struct switcheroo_irqstat *s,
+				  int state)
+{
+	unsigned long flags;
+
+	if (!s->irq || !switcheroo_kstat_irqs)
+		return;
+
+	spin_lock_irqsave(&s->lock, flags);
+	switcheroo_irqstat_sample(s);
+	s->state = state;
+	s->watch_count = s->last_count;
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	if (state != SWITCHEROO_IRQ_ON && *s->warn_rate)
+		schedule_delayed_work(&s->watch, HZ);
+}
+
+/* Per state: interrupt count, time in state (ms) and average rate (irq/s) */
+static int switcheroo_irqstat_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_irqstat *s = m->private;
+	u64 count[SWITCHEROO_IRQ_STATES], time_ns[SWITCHEROO_IRQ_STATES];
+	unsigned long flags;
+	int i, state;
+
+	spin_lock_irqsave(&s->lock, flags);
+	if (s->irq && switcheroo_kstat_irqs)
+		switcheroo_irqstat_sample(s);
+	state = s->state;
+	memcpy(count, s->count, sizeof(count));
+	memcpy(time_ns, s->time_ns, sizeof(time_ns));
+	spin_unlock_irqrestore(&s->lock, flags);
+
+	seq_printf(m, "irq %u\nstate %s\nwarn_rate %u\n", s->irq,
+		   switcheroo_irq_state_names[state], *s->warn_rate);
+	for (i = 0; i < SWITCHEROO_IRQ_STATES; i++) {
+		u64 ms = div_u64(time_ns[i], NSEC_PER_MSEC);
+
+		seq_printf(m, "%s %llu %llu %llu\n",
+			   switcheroo_irq_state_names[i], count[i], ms,
+			   ms ? div64_u64(count[i] * MSEC_PER_SEC, ms) : 0);
+	}
+	return 0;
+}
+
+static int switcheroo_irqstat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_irqstat_show, inode->i_private);
+}
+
+static const struct file_operations switcheroo_irqstat_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_irqstat_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void switcheroo_irqstat_init(struct switcheroo_irqstat *s,
+			     struct dentry *dir)
+{
+	spin_lock_init(&s->lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,7,0)
+	INIT_DEFERRABLE_WORK(&s->watch, switcheroo_irqstat_watch);
+#else
+	INIT_DELAYED_WORK_DEFERRABLE(&s->watch, switcheroo_irqstat_watch);
+#endif
+
+	switcheroo_kstat_irqs = (void *)kallsyms_lookup_name("kstat_irqs");
+	if (!switcheroo_kstat_irqs)
+		printk("%s: Can't hook to kstat_irqs, no irq accounting\n",
+		       s->name);
+
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("irq", 0444, dir, s,
+				    &switcheroo_irqstat_fops);
+}
+
+void switcheroo_irqstat_exit(struct switcheroo_irqstat *s)
+{
+	if (s->watch.work.func)
+		cancel_delayed_work_sync(&s->watch);
+}
@@ -0,0 +1,57 @@
+/*
+ * Interrupt accounting for the discrete GPU across power states
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_IRQSTAT_H
+#define _SWITCHEROO_IRQSTAT_H
+
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct dentry;
+
+/*
+ * The kernel already counts every interrupt delivered on a line, so rather
+ * than hanging another handler off a possibly shared line (and keeping it
+ * unmasked while the device is off) we sample that count each time the
+ * device changes state and charge the difference to the state it's
+ * leaving.  While the device is off or in transition a once a second
+ * check warns if the line is still firing faster than the threshold
+ * (0 turns the check off).  It's deferrable, an idle cpu isn't woken
+ * just to look at the count.
+ */
+enum {
+	SWITCHEROO_IRQ_ON,
+	SWITCHEROO_IRQ_OFF,
+	SWITCHEROO_IRQ_TRANSITION,
+	SWITCHEROO_IRQ_STATES,
+};
+
+struct switcheroo_irqstat {
+	const char *name;
+	unsigned int irq;
+	unsigned int *warn_rate;
+	spinlock_t lock;
+	int state;
+	unsigned int last_count;
+	unsigned int watch_count;
+	ktime_t last_time;
+	u64 count[SWITCHEROO_IRQ_STATES];
+	u64 time_ns[SWITCHEROO_IRQ_STATES];
+	struct delayed_work watch;
+};
+
+/* Start accounting once the irq number is known.  Callable from atomic
+ * context, like the probes that discover it. */
+void switcheroo_irqstat_start(struct switcheroo_irqstat *s, unsigned int irq,
+			      int state);
+void switcheroo_irqstat_set_state(struct switcheroo_irqstat *s, int state);
+void switcheroo_irqstat_init(struct switcheroo_irqstat *s, struct dentry *dir);
+/* Safe if init was never reached */
+void switcheroo_irqstat_exit(struct switcheroo_irqstat *s);
+
+#endif /* _SWITCHEROO_IRQSTAT_H */
@@ -0,0 +1,55 @@
+/*
+ * Layout of the status page mmap'd from /dev/asus-switcheroo and
+ * /dev/byo-switcheroo, for the modules and for userspace monitors alike
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_STATUS_H
+#define _SWITCHEROO_STATUS_H
+
+#include <linux/types.h>
+
+/*
+ * The page is written by the module only and mapped read-only.  seq is
+ * odd while an update is in progress, so a reader copies the page and
+ * tries again if seq was odd or changed while it was copying:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+ *		memcpy(&copy, page, sizeof(copy));
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != page->seq);
+ *
+ * Residency is as of update_ns; add the time since since_ns to the
+ * current state for a live figure.  Both are CLOCK_MONOTONIC.  Fields
+ * are only ever added at the end, and version goes up when they are.
+ */
+#define SWITCHEROO_STATUS_VERSION 1
+
+/* The things we switch, indexes into res[] */
+enum {
+	SWITCHEROO_STAT_IGD_POWER,
+	SWITCHEROO_STAT_DIS_POWER,
+	SWITCHEROO_STAT_MUX,
+	SWITCHEROO_STAT_DUMMY,
+	SWITCHEROO_STATS,
+};
+
+struct switcheroo_status_page {
+	__u32 seq;
+	__u32 version;
+	__u64 transition_seq;		/* transitions of anything so far */
+	__u64 update_ns;
+	struct {
+		__u32 state;		/* 0 off/igd/d3hot, 1 on/dis/d0 */
+		__u32 pad;
+		__u64 since_ns;		/* entered the current state */
+		__u64 time_ns[2];	/* time spent in each state */
+		__u64 transitions;
+		__u64 last_ns;		/* latency of the last operation */
+	} res[SWITCHEROO_STATS];
+};
+
+#endif /* _SWITCHEROO_STATUS_H */
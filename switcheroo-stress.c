@@ -0,0 +1,345 @@
+/*
+ * Concurrent stress mode for the switcheroo handlers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/atomic.h>
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/suspend.h>
+#include <linux/uaccess.h>
+
+#include "switcheroo-common.h"
+#include "switcheroo-stress.h"
+
+static const char * const switcheroo_stress_names[] = {
+	"switch", "power", "suspend", "request", "query",
+};
+
+static const char * const switcheroo_stress_requests[] = {
+	"DIS", "ON", "IGD", "OFF",
+};
+
+#define SWITCHEROO_STRESS_MAX_SECONDS 600
+#define SWITCHEROO_STRESS_MAX_THREADS 16
+/* Outlier threshold when there's no bench_p99_budget_us to go by */
+#define SWITCHEROO_STRESS_OUTLIER_US 10000
+
+struct switcheroo_stress_thread {
+	struct switcheroo_stress *s;
+	int job;
+	unsigned int iter;
+	struct task_struct *task;
+	u64 last_mux_ns;
+	u64 busy_queries;
+	struct switcheroo_stress_result r;
+};
+
+static void switcheroo_stress_core_lock(struct switcheroo_stress_thread *t)
+{
+	ktime_t start;
+	u64 wait_ns;
+
+	if (mutex_trylock(&t->s->req->core_lock))
+		return;
+
+	start = ktime_get();
+	mutex_lock(&t->s->req->core_lock);
+	wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	t->r.contended++;
+	t->r.max_wait_ns = max(t->r.max_wait_ns, wait_ns);
+}
+
+/* The PM notifiers run outside the core's lock, as they do for real,
+ * and one suspend is ever in flight */
+static void switcheroo_stress_pm_notify(struct switcheroo_stress *s,
+					unsigned long val)
+{
+	struct notifier_block *nb = &s->policy->pm_nb;
+
+	s->req->pm_nb.notifier_call(&s->req->pm_nb, val, NULL);
+	if (nb->notifier_call)
+		nb->notifier_call(nb, val, NULL);
+}
+
+static int switcheroo_stress_suspend(struct switcheroo_stress_thread *t)
+{
+	struct vga_switcheroo_handler *h = t->s->bench->handler;
+	int ret = 0;
+
+	mutex_lock(&t->s->suspend_lock);
+	switcheroo_stress_pm_notify(t->s, PM_SUSPEND_PREPARE);
+
+	switcheroo_stress_core_lock(t);
+	atomic_inc(&t->s->in_flight);
+	ret |= h->power_state(VGA_SWITCHEROO_DIS, VGA_SWITCHEROO_OFF);
+	ret |= h->power_state(VGA_SWITCHEROO_IGD, VGA_SWITCHEROO_OFF);
+	ret |= h->power_state(VGA_SWITCHEROO_IGD, VGA_SWITCHEROO_ON);
+	ret |= h->power_state(VGA_SWITCHEROO_DIS, VGA_SWITCHEROO_ON);
+	ret |= h->switchto(VGA_SWITCHEROO_IGD);
+	atomic_dec(&t->s->in_flight);
+	mutex_unlock(&t->s->req->core_lock);
+
+	switcheroo_stress_pm_notify(t->s, PM_POST_SUSPEND);
+	mutex_unlock(&t->s->suspend_lock);
+	return ret;
+}
+
+/* The mux residency total should only ever go up, seeing it go backwards
+ * means an update raced with us */
+static int switcheroo_stress_query(struct switcheroo_stress_thread *t)
+{
+	struct switcheroo_stats *st = t->s->stats;
+	struct switcheroo_residency res[SWITCHEROO_STATS];
+	unsigned long flags;
+	ktime_t start = ktime_get(), now;
+	u64 mux_ns;
+	int i;
+
+	if (atomic_read(&t->s->in_flight))
+		t->busy_queries++;
+
+	if (!spin_trylock_irqsave(&st->lock, flags)) {
+		t->r.contended++;
+		spin_lock_irqsave(&st->lock, flags);
+		t->r.max_wait_ns = max(t->r.max_wait_ns,
+				       (u64)ktime_to_ns(ktime_sub(ktime_get(),
+								  start)));
+	}
+	now = ktime_get();
+	for (i = 0; i < SWITCHEROO_STATS; i++)
+		switcheroo_stats_charge(&st->res[i], now);
+	memcpy(res, st->res, sizeof(res));
+	spin_unlock_irqrestore(&st->lock, flags);
+
+	mux_ns = res[SWITCHEROO_STAT_MUX].time_ns[0] +
+		 res[SWITCHEROO_STAT_MUX].time_ns[1];
+	if (mux_ns < t->last_mux_ns)
+		return -EIO;
+	t->last_mux_ns = mux_ns;
+	return 0;
+}
+
+static int switcheroo_stress_op(struct switcheroo_stress_thread *t)
+{
+	struct vga_switcheroo_handler *h = t->s->bench->handler;
+	unsigned int iter = t->iter++;
+	int ret;
+
+	switch (t->job) {
+	case SWITCHEROO_STRESS_QUERY:
+		return switcheroo_stress_query(t);
+	case SWITCHEROO_STRESS_SUSPEND:
+		return switcheroo_stress_suspend(t);
+	case SWITCHEROO_STRESS_REQUEST:
+		/* Through the window, as the request file would, so they
+		 * collapse and go out from the work; nothing to fail */
+		switcheroo_request_queue(t->s->req,
+					 switcheroo_stress_requests[iter & 3],
+					 false);
+		return 0;
+	}
+
+	switcheroo_stress_core_lock(t);
+	atomic_inc(&t->s->in_flight);
+	if (t->job == SWITCHEROO_STRESS_SWITCH)
+		ret = h->switchto(iter & 1 ? VGA_SWITCHEROO_IGD :
+				  VGA_SWITCHEROO_DIS);
+	else
+		ret = h->power_state(VGA_SWITCHEROO_DIS, iter & 1 ?
+				     VGA_SWITCHEROO_ON : VGA_SWITCHEROO_OFF);
+	atomic_dec(&t->s->in_flight);
+	mutex_unlock(&t->s->req->core_lock);
+	return ret;
+}
+
+static int switcheroo_stress_thread(void *data)
+{
+	struct switcheroo_stress_thread *t = data;
+
+	while (!kthread_should_stop()) {
+		ktime_t start = ktime_get();
+		u64 ns;
+
+		if (switcheroo_stress_op(t))
+			t->r.errors++;
+		ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+		t->r.ops++;
+		t->r.total_ns += ns;
+		t->r.max_ns = max(t->r.max_ns, ns);
+		if (ns > t->s->outlier_ns)
+			t->r.outliers++;
+		cond_resched();
+	}
+	return 0;
+}
+
+static void switcheroo_stress_merge(struct switcheroo_stress_result *to,
+				    struct switcheroo_stress_result *from)
+{
+	to->ops += from->ops;
+	to->errors += from->errors;
+	to->total_ns += from->total_ns;
+	to->max_ns = max(to->max_ns, from->max_ns);
+	to->outliers += from->outliers;
+	to->contended += from->contended;
+	to->max_wait_ns = max(to->max_wait_ns, from->max_wait_ns);
+}
+
+static int switcheroo_stress_run(struct switcheroo_stress *s,
+				 unsigned int seconds, unsigned int threads)
+{
+	struct switcheroo_stress_thread *t;
+	unsigned int i, count = threads * SWITCHEROO_STRESS_JOBS;
+	ktime_t begin;
+	int ret = 0;
+
+	t = kcalloc(count, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	mutex_lock(&s->lock);
+	memset(s->res, 0, sizeof(s->res));
+	s->busy_queries = 0;
+	s->seconds = seconds;
+	s->threads = threads;
+	s->outlier_ns = (u64)(*s->bench->p99_budget_us ?
+			      *s->bench->p99_budget_us :
+			      SWITCHEROO_STRESS_OUTLIER_US) * NSEC_PER_USEC;
+
+	begin = ktime_get();
+	for (i = 0; i < count; i++) {
+		t[i].s = s;
+		t[i].job = i % SWITCHEROO_STRESS_JOBS;
+		t[i].task = kthread_run(switcheroo_stress_thread, &t[i],
+					"switcheroo-%s/%u",
+					switcheroo_stress_names[t[i].job],
+					i / SWITCHEROO_STRESS_JOBS);
+		if (IS_ERR(t[i].task)) {
+			ret = PTR_ERR(t[i].task);
+			t[i].task = NULL;
+			break;
+		}
+	}
+
+	if (!ret)
+		msleep_interruptible(seconds * MSEC_PER_SEC);
+
+	for (i = 0; i < count; i++) {
+		if (!t[i].task)
+			continue;
+		kthread_stop(t[i].task);
+		switcheroo_stress_merge(&s->res[t[i].job], &t[i].r);
+		s->busy_queries += t[i].busy_queries;
+	}
+	s->elapsed_ns = ktime_to_ns(ktime_sub(ktime_get(), begin));
+
+	for (i = 0; i < SWITCHEROO_STRESS_JOBS && !ret; i++)
+		if (s->res[i].errors)
+			ret = -EIO;
+	mutex_unlock(&s->lock);
+
+	kfree(t);
+	return ret;
+}
+
+/*
+ * Per job: ops, ops/s, errors, average and max latency (us), ops over the
+ * outlier threshold, times the lock was found held and the longest wait
+ * for it (us).  Then how many status queries ran while a switch was in
+ * flight, and their rate.
+ */
+static int switcheroo_stress_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_stress *s = m->private;
+	u64 ms;
+	int i;
+
+	mutex_lock(&s->lock);
+	ms = max_t(u64, div_u64(s->elapsed_ns, NSEC_PER_MSEC), 1);
+	seq_printf(m, "backend %s\nseconds %u\nthreads %u\noutlier_us %llu\n",
+		   switcheroo_backend->name, s->seconds, s->threads,
+		   div_u64(s->outlier_ns, NSEC_PER_USEC));
+	for (i = 0; i < SWITCHEROO_STRESS_JOBS; i++) {
+		struct switcheroo_stress_result *r = &s->res[i];
+
+		seq_printf(m, "%s %llu %llu %llu %llu %llu %llu %llu %llu\n",
+			   switcheroo_stress_names[i], r->ops,
+			   div64_u64(r->ops * MSEC_PER_SEC, ms), r->errors,
+			   r->ops ? div64_u64(r->total_ns,
+					      r->ops * NSEC_PER_USEC) : 0,
+			   div_u64(r->max_ns, NSEC_PER_USEC), r->outliers,
+			   r->contended, div_u64(r->max_wait_ns,
+						 NSEC_PER_USEC));
+	}
+	seq_printf(m, "busy_queries %llu %llu\n", s->busy_queries,
+		   div64_u64(s->busy_queries * MSEC_PER_SEC, ms));
+	mutex_unlock(&s->lock);
+	return 0;
+}
+
+static int switcheroo_stress_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_stress_show, inode->i_private);
+}
+
+static ssize_t switcheroo_stress_write(struct file *file,
+				       const char __user *buf,
+				       size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	unsigned int seconds, threads = 1;
+	char tmp[32];
+	size_t len = min(count, sizeof(tmp) - 1);
+	int ret;
+
+	if (copy_from_user(tmp, buf, len))
+		return -EFAULT;
+	tmp[len] = 0;
+
+	if (sscanf(tmp, "%u %u", &seconds, &threads) < 1)
+		return -EINVAL;
+	if (!seconds || seconds > SWITCHEROO_STRESS_MAX_SECONDS ||
+	    !threads || threads > SWITCHEROO_STRESS_MAX_THREADS)
+		return -EINVAL;
+
+	ret = switcheroo_stress_run(m->private, seconds, threads);
+	return ret ? ret : count;
+}
+
+static const struct file_operations switcheroo_stress_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_stress_open,
+	.read = seq_read,
+	.write = switcheroo_stress_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void switcheroo_stress_init(struct switcheroo_stress *s,
+			    struct switcheroo_bench *b,
+			    struct switcheroo_request *r,
+			    struct switcheroo_policy *p,
+			    struct dentry *dir)
+{
+	if (IS_ERR_OR_NULL(dir) || !switcheroo_backend_simulated())
+		return;
+
+	s->bench = b;
+	s->req = r;
+	s->policy = p;
+	s->stats = r->stats;
+	mutex_init(&s->lock);
+	mutex_init(&s->suspend_lock);
+	debugfs_create_file("stress", 0600, dir, s, &switcheroo_stress_fops);
+}
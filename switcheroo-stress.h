@@ -0,0 +1,80 @@
+/*
+ * Concurrent stress mode for the switcheroo handlers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_STRESS_H
+#define _SWITCHEROO_STRESS_H
+
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+struct dentry;
+struct switcheroo_bench;
+struct switcheroo_policy;
+struct switcheroo_request;
+struct switcheroo_stats;
+
+/*
+ * Like the benchmark, only offered on the simulated backends.  Writing
+ * "seconds [threads]" to the stress file starts that many kernel threads
+ * for each of five jobs and lets them run against each other for that
+ * long: switching the mux back and forth, powering the discrete device
+ * off and on, a simulated suspend/resume, writes to the request queue,
+ * and status queries that snapshot the residency counters the way the
+ * residency file does.  The suspend runs the request queue's and the
+ * policy's PM notifiers around both devices going off, then back on and
+ * the mux put back on IGD, as the core does on resume, so the queue is
+ * suspended and resumed underneath the request writers.  Handler calls
+ * take the request queue's mutex standing in for the switcheroo core's,
+ * since the core never calls a handler concurrently with itself; the
+ * queries, stats, trace and firmware budget paths run unserialized
+ * against them, as they do for real.  Run it on a lockdep or KCSAN kernel
+ * to have it find anything more than slow paths.
+ */
+enum {
+	SWITCHEROO_STRESS_SWITCH,
+	SWITCHEROO_STRESS_POWER,
+	SWITCHEROO_STRESS_SUSPEND,
+	SWITCHEROO_STRESS_REQUEST,
+	SWITCHEROO_STRESS_QUERY,
+	SWITCHEROO_STRESS_JOBS,
+};
+
+struct switcheroo_stress_result {
+	u64 ops;
+	u64 errors;
+	u64 total_ns;
+	u64 max_ns;
+	u64 outliers;
+	u64 contended;		/* core lock or stats lock was held */
+	u64 max_wait_ns;
+};
+
+struct switcheroo_stress {
+	struct switcheroo_bench *bench;
+	struct switcheroo_request *req;
+	struct switcheroo_policy *policy;
+	struct switcheroo_stats *stats;
+	struct mutex lock;		/* one run at a time */
+	struct mutex suspend_lock;	/* one suspend at a time */
+	atomic_t in_flight;
+	u64 outlier_ns;
+	unsigned int seconds;
+	unsigned int threads;
+	u64 elapsed_ns;
+	u64 busy_queries;		/* queries made while a switch ran */
+	struct switcheroo_stress_result res[SWITCHEROO_STRESS_JOBS];
+};
+
+/* After switcheroo_request_simulated, which hooks the handler to the
+ * request queue, and before switcheroo_policy_init */
+void switcheroo_stress_init(struct switcheroo_stress *s,
+			    struct switcheroo_bench *b,
+			    struct switcheroo_request *r,
+			    struct switcheroo_policy *p, struct dentry *dir);
+
+#endif /* _SWITCHEROO_STRESS_H */
@@ -0,0 +1,153 @@
+/*
+ * Flight recorder for switcheroo handler calls and probe hits
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/module.h>
+#include <linux/debugfs.h>
+#include <linux/kdebug.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+#include "switcheroo-trace.h"
+
+#define SWITCHEROO_TRACE_ENTRIES 64
+
+struct switcheroo_trace_entry {
+	u64 ts_ns;
+	u64 duration_ns;
+	const char *op;
+	char method[16];
+	u32 arg;
+	int status;
+};
+
+struct switcheroo_trace_ring {
+	unsigned long head;
+	struct switcheroo_trace_entry entries[SWITCHEROO_TRACE_ENTRIES];
+};
+
+static DEFINE_PER_CPU(struct switcheroo_trace_ring, switcheroo_trace_rings);
+
+void switcheroo_trace(const char *op, const char *method, u32 arg,
+		      int status, ktime_t start)
+{
+	struct switcheroo_trace_ring *ring;
+	struct switcheroo_trace_entry *e;
+	ktime_t now = ktime_get();
+	unsigned long flags;
+	size_t len;
+
+	local_irq_save(flags);
+	ring = this_cpu_ptr(&switcheroo_trace_rings);
+	e = &ring->entries[ring->head++ % SWITCHEROO_TRACE_ENTRIES];
+	e->ts_ns = ktime_to_ns(now);
+	e->duration_ns = ktime_to_ns(ktime_sub(now, start));
+	e->op = op;
+	e->arg = arg;
+	e->status = status;
+	e->method[0] = 0;
+	if (method) {
+		len = strlen(method);
+		if (len >= sizeof(e->method))
+			method += len - (sizeof(e->method) - 1);
+		strlcpy(e->method, method, sizeof(e->method));
+	}
+	local_irq_restore(flags);
+}
+
+/* Oldest first, for one cpu.  m is either a seq_file or NULL for printk,
+ * in which case name prefixes the lines */
+static void switcheroo_trace_dump_cpu(struct seq_file *m, const char *name,
+				      int cpu)
+{
+	struct switcheroo_trace_ring *ring = per_cpu_ptr(&switcheroo_trace_rings,
+							 cpu);
+	unsigned long head = ACCESS_ONCE(ring->head), i;
+
+	i = head > SWITCHEROO_TRACE_ENTRIES ? head - SWITCHEROO_TRACE_ENTRIES : 0;
+	for (; i < head; i++) {
+		struct switcheroo_trace_entry e;
+
+		e = ring->entries[i % SWITCHEROO_TRACE_ENTRIES];
+		if (!e.op)
+			continue;
+
+		if (m)
+			seq_printf(m, "%llu %d %s %s 0x%x %d %llu\n",
+				   e.ts_ns, cpu, e.op,
+				   e.method[0] ? e.method : "-", e.arg,
+				   e.status, div_u64(e.duration_ns,
+						     NSEC_PER_USEC));
+		else
+			printk(KERN_ERR "%s: %llu %d %s %s 0x%x %d %llu\n",
+			       name, e.ts_ns, cpu, e.op,
+			       e.method[0] ? e.method : "-", e.arg, e.status,
+			       div_u64(e.duration_ns, NSEC_PER_USEC));
+	}
+}
+
+/* One line per record: timestamp (ns), cpu, operation, method, argument,
+ * status, duration (us) */
+static int switcheroo_trace_show(struct seq_file *m, void *unused)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		switcheroo_trace_dump_cpu(m, NULL, cpu);
+	return 0;
+}
+
+static int switcheroo_trace_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_trace_show, NULL);
+}
+
+static const struct file_operations switcheroo_trace_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_trace_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Every user has a die notifier, whichever runs first dumps the rings */
+static int switcheroo_trace_die(struct notifier_block *nb, unsigned long val,
+				void *data)
+{
+	struct switcheroo_trace_user *u =
+		container_of(nb, struct switcheroo_trace_user, die_nb);
+	static int dumped;
+	int cpu;
+
+	if (val != DIE_OOPS || dumped++)
+		return NOTIFY_DONE;
+
+	printk(KERN_ERR "%s: recent switcheroo activity:\n", u->name);
+	for_each_possible_cpu(cpu)
+		switcheroo_trace_dump_cpu(NULL, u->name, cpu);
+	return NOTIFY_DONE;
+}
+
+void switcheroo_trace_init(struct switcheroo_trace_user *u, const char *name,
+			   struct dentry *dir)
+{
+	u->name = name;
+	if (!IS_ERR_OR_NULL(dir))
+		debugfs_create_file("trace", 0444, dir, NULL,
+				    &switcheroo_trace_fops);
+
+	u->die_nb.notifier_call = switcheroo_trace_die;
+	register_die_notifier(&u->die_nb);
+}
+
+/* Safe if init was never reached */
+void switcheroo_trace_exit(struct switcheroo_trace_user *u)
+{
+	if (u->die_nb.notifier_call)
+		unregister_die_notifier(&u->die_nb);
+}
@@ -0,0 +1,49 @@
+/*
+ * Flight recorder for switcheroo handler calls and probe hits
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_TRACE_H
+#define _SWITCHEROO_TRACE_H
+
+#include <linux/ktime.h>
+#include <linux/notifier.h>
+#include <linux/types.h>
+
+struct dentry;
+
+/*
+ * Every handler call, probe hit and irq gate action drops a fixed size
+ * record in a per-cpu ring.  Each cpu only ever writes its own ring, with
+ * interrupts off for the few stores it takes, so there's no lock to take
+ * and it can stay on all the time.  The rings are readable from debugfs
+ * and dumped to the log if the kernel oopses, so there's some history to
+ * look at when a switch hangs or leaves the screen black.  There's one
+ * set of rings per module, so the combined module's handler and hooks
+ * all record into the same ones and an oops dumps them once.
+ */
+struct switcheroo_trace_user {
+	const char *name;
+	struct notifier_block die_nb;
+};
+
+/* op must be a string that outlives the module, method is copied (the
+ * tail end of it, if it's a long ACPI path) */
+void switcheroo_trace(const char *op, const char *method, u32 arg,
+		      int status, ktime_t start);
+
+/* For things that happen rather than take time */
+static inline void switcheroo_trace_event(const char *op,
+					  const char *method, u32 arg,
+					  int status)
+{
+	switcheroo_trace(op, method, arg, status, ktime_get());
+}
+
+void switcheroo_trace_init(struct switcheroo_trace_user *u, const char *name,
+			   struct dentry *dir);
+void switcheroo_trace_exit(struct switcheroo_trace_user *u);
+
+#endif /* _SWITCHEROO_TRACE_H */
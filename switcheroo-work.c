@@ -0,0 +1,37 @@
+/*
+ * Deferred work for the jprobe hacks, with queue latency tracking
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#include <linux/module.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+
+#include "switcheroo-work.h"
+
+/* m->private is a NULL terminated array of work items */
+static int switcheroo_work_show(struct seq_file *m, void *unused)
+{
+	struct switcheroo_work **sw;
+
+	for (sw = m->private; *sw; sw++)
+		seq_printf(m, "%s %u %llu %llu\n", (*sw)->name, (*sw)->runs,
+			   div_u64((*sw)->last_ns, NSEC_PER_USEC),
+			   div_u64((*sw)->max_ns, NSEC_PER_USEC));
+	return 0;
+}
+
+static int switcheroo_work_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, switcheroo_work_show, inode->i_private);
+}
+
+const struct file_operations switcheroo_work_fops = {
+	.owner = THIS_MODULE,
+	.open = switcheroo_work_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
@@ -0,0 +1,65 @@
+/*
+ * Deferred work for the jprobe hacks, with queue latency tracking
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+
+#ifndef _SWITCHEROO_WORK_H
+#define _SWITCHEROO_WORK_H
+
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+
+/*
+ * The probes can't sleep, so anything that registers probes or requests
+ * irqs gets pushed out to a workqueue.  Some of that sits on the power on
+ * path, so each module uses its own high priority ordered queue rather
+ * than the shared system one.  Being ordered, items run in the order the
+ * probes queued them.  We keep track of how long each item waited to run.
+ */
+struct switcheroo_work {
+	struct work_struct work;
+	const char *name;
+	ktime_t queued;
+	unsigned int runs;
+	u64 last_ns;
+	u64 max_ns;
+};
+
+#define SWITCHEROO_WORK(n, f) {					\
+	.work = __WORK_INITIALIZER((n).work, (f)),		\
+	.name = #f,						\
+}
+
+static inline struct workqueue_struct *switcheroo_alloc_wq(const char *name)
+{
+	return alloc_ordered_workqueue(name, WQ_HIGHPRI);
+}
+
+static inline void switcheroo_queue_work(struct workqueue_struct *wq,
+					 struct switcheroo_work *sw)
+{
+	if (!work_pending(&sw->work))
+		sw->queued = ktime_get();
+	queue_work(wq, &sw->work);
+}
+
+/* Call first thing from the work function */
+static inline void switcheroo_work_ran(struct work_struct *work)
+{
+	struct switcheroo_work *sw = container_of(work, struct switcheroo_work,
+						  work);
+
+	sw->last_ns = ktime_to_ns(ktime_sub(ktime_get(), sw->queued));
+	if (sw->last_ns > sw->max_ns)
+		sw->max_ns = sw->last_ns;
+	sw->runs++;
+}
+
+/* debugfs file of how long each item waited to run, its private data a
+ * NULL terminated array of work items */
+extern const struct file_operations switcheroo_work_fops;
+
+#endif /* _SWITCHEROO_WORK_H */